@@ -0,0 +1,146 @@
+#pragma once
+
+/**
+ * Random distortions of the train images, drawn anew every time a sample is gathered so every pass sees different images.
+ * A random affine transform(shift, rotation and scale) and an elastic distortion(a smoothed random displacement field, Simard et al. 2003)
+ * map each output pixel back to a point of the source image, which is sampled with the vectorized `bilinear` kernel.
+ * Run by the workers of a `Prefetcher`, so the cost is hidden behind the training.
+ */
+
+#include "Config.h"
+#include "Kernel.h"
+#include "Random.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace nn {
+	/** Ranges of the random distortions. A range of 0 turns the distortion off. */
+	struct AugmentParams {
+		/* Pixels the image is moved by at most, on each axis */
+		double shift;
+		/* Degrees the image is rotated by at most, either way */
+		double rotation;
+		/* The image is scaled by 1 - scale to 1 + scale */
+		double scale;
+		/* Pixels the elastic field moves a point by, before smoothing, and the standard deviation of the smoothing in pixels */
+		double elastic_alpha, elastic_sigma;
+
+		static AugmentParams defaults() {
+			AugmentParams params = { AUGMENT_SHIFT, AUGMENT_ROTATION, AUGMENT_SCALE, AUGMENT_ELASTIC_ALPHA, AUGMENT_ELASTIC_SIGMA };
+			return params;
+		}
+	};
+
+	template<typename T, typename S = T>
+	class Augmenter {
+	public:
+		/** Buffers of a thread applying the distortions, to reuse over the images */
+		struct Workspace {
+			std::vector<T> image, x, y, dx, dy, smoothed, out;
+
+			explicit Workspace(const Augmenter& augmenter) {
+				const int n = augmenter.width * augmenter.height;
+				image.resize((augmenter.width + 2) * (augmenter.height + 2), 0);
+				x.resize(n);
+				y.resize(n);
+				dx.resize(n);
+				dy.resize(n);
+				smoothed.resize(n);
+				out.resize(n);
+			}
+		};
+
+		Augmenter(int width, int height, const AugmentParams& params)
+			: width(width), height(height), params(params)
+		{
+			/* Normalized Gaussian of the elastic field, cut at 3 sigma */
+			if (params.elastic_alpha > 0 && params.elastic_sigma > 0) {
+				const int radius = std::max(1, (int) std::ceil(3 * params.elastic_sigma));
+				T sum = 0;
+				for (int k = -radius; k <= radius; k++) {
+					gaussian.push_back((T) std::exp(-0.5 * k * k / (params.elastic_sigma * params.elastic_sigma)));
+					sum += gaussian.back();
+				}
+				for (size_t k = 0; k < gaussian.size(); k++) gaussian[k] /= sum;
+			}
+		}
+
+		/** Multiply-adds of an image, roughly, to cost the jobs of the workers */
+		double cost() const {
+			return (double) width * height * (8 + 4 * gaussian.size());
+		}
+
+		/**
+		 * Distorts the image `in`, `width` x `height` bytes, into the padded row `out` of the network input, multiplied by `scale`.
+		 * @param random Generator of the calling thread.
+		 */
+		void apply(const unsigned char* in, T scale, S* out, Random& random, Workspace& ws) const {
+			const int n = width * height;
+			const int row = width + 2;
+			for (int v = 0; v < height; v++) {
+				for (int u = 0; u < width; u++) {
+					ws.image[(v + 1) * row + u + 1] = scale * (T) in[v * width + u];
+				}
+			}
+
+			/* The inverse of the transform, from an output pixel back to the source around the center */
+			const double angle = (2 * random.uniform() - 1) * params.rotation * 3.14159265358979323846 / 180;
+			const double zoom = 1 + (2 * random.uniform() - 1) * params.scale;
+			const double shift_x = (2 * random.uniform() - 1) * params.shift, shift_y = (2 * random.uniform() - 1) * params.shift;
+			const T a = (T) (std::cos(angle) / zoom), b = (T) (std::sin(angle) / zoom);
+			const T cx = (T) ((width - 1) / 2.0), cy = (T) ((height - 1) / 2.0);
+
+			const bool elastic = !gaussian.empty();
+			if (elastic) {
+				displacement(random, ws.dx, ws);
+				displacement(random, ws.dy, ws);
+			}
+			for (int v = 0; v < height; v++) {
+				for (int u = 0; u < width; u++) {
+					const int i = v * width + u;
+					const T du = (T) u - cx - (T) shift_x, dv = (T) v - cy - (T) shift_y;
+					ws.x[i] = a * du + b * dv + cx + (elastic ? ws.dx[i] : 0);
+					ws.y[i] = -b * du + a * dv + cy + (elastic ? ws.dy[i] : 0);
+				}
+			}
+
+			const kernel::Ops<T, S>& ops = kernel::ops<T, S>();
+			ops.bilinear(n, &ws.image[0], width, height, &ws.x[0], &ws.y[0], &ws.out[0]);
+			ops.narrow(n, &ws.out[0], out);
+		}
+
+	private:
+		const int width, height;
+		const AugmentParams params;
+		std::vector<T> gaussian;
+
+		/* A field of uniform displacements in [-1, 1], smoothed by the Gaussian on both axes and multiplied by alpha, into `field` */
+		void displacement(Random& random, std::vector<T>& field, Workspace& ws) const {
+			const int radius = (int) gaussian.size() / 2;
+			for (int i = 0; i < width * height; i++) {
+				field[i] = (T) (2 * random.uniform() - 1);
+			}
+			/* Outside the image, the edge is repeated */
+			for (int v = 0; v < height; v++) {
+				for (int u = 0; u < width; u++) {
+					T sum = 0;
+					for (int k = -radius; k <= radius; k++) {
+						sum += gaussian[k + radius] * field[v * width + std::min(std::max(u + k, 0), width - 1)];
+					}
+					ws.smoothed[v * width + u] = sum;
+				}
+			}
+			const T alpha = (T) params.elastic_alpha;
+			for (int v = 0; v < height; v++) {
+				for (int u = 0; u < width; u++) {
+					T sum = 0;
+					for (int k = -radius; k <= radius; k++) {
+						sum += gaussian[k + radius] * ws.smoothed[std::min(std::max(v + k, 0), height - 1) * width + u];
+					}
+					field[v * width + u] = alpha * sum;
+				}
+			}
+		}
+	};
+}
@@ -1,8 +1,43 @@
 #pragma once
 
+#include "Half.h"
+
 namespace nn {
+	/* Default scalar type. Networks can also be built with float, see `ScalarType` */
 	typedef double NUM_TYPE;
 
+	/**
+	 * Scalar types a network can be trained with, recorded in the checkpoint header.
+	 * BFloat16 and Float16 are the mixed precision modes, trained in float32 with the weights and outputs stored in 16 bits.
+	 * Their checkpoints hold the float32 master weights.
+	 */
+	namespace scalar_types {
+		enum {
+			Float64 = 0,
+			Float32,
+			BFloat16,
+			Float16,
+		};
+	}
+
+	template<typename T> struct ScalarType;
+	template<> struct ScalarType<double> {
+		static const char id = scalar_types::Float64;
+		static const char* name() { return "float64"; }
+	};
+	template<> struct ScalarType<float> {
+		static const char id = scalar_types::Float32;
+		static const char* name() { return "float32"; }
+	};
+	template<> struct ScalarType<bf16> {
+		static const char id = scalar_types::BFloat16;
+		static const char* name() { return "bfloat16"; }
+	};
+	template<> struct ScalarType<fp16> {
+		static const char id = scalar_types::Float16;
+		static const char* name() { return "float16"; }
+	};
+
 #define DEFAULT_HIDDEN_LAYER_1 200
 #define DEFAULT_HIDDEN_LAYER_2 100
 #define DEFAULT_MSE_THRESHOLD 0.001
@@ -11,6 +46,9 @@ namespace nn {
 #define DEFAULT_ACTIVATION_LAYER_2 nn::activation::Sigmoid
 #define DEFAULT_ACTIVATION_LAYER_3 nn::activation::Sigmoid
 
+// Sigmoid and Tanh from a table of this many points with linear interpolation, instead of the vectorized exp
+//#define ACTIVATION_TABLE 4096
+
 //#define PRINT_TRAIN_ERROR
 
 #define BATCH_TRAIN
@@ -26,47 +64,58 @@ namespace nn {
 	#define CHECKPOINT_EPOCHES 10
 #endif
 
+/* Samples a streamed train set(see `nn::SampleStream`) holds to shuffle, and reads into memory at a time to train with */
+#define STREAM_BUFFER 65536
+
+/* Samples the network is predicted on at a time by `nn::Evaluator` */
+#define EVALUATE_BATCH 256
+
+/* Ranges of the random distortions of the train images with -augment, see `nn::AugmentParams` */
+#define AUGMENT_SHIFT 2.0
+#define AUGMENT_ROTATION 10.0
+#define AUGMENT_SCALE 0.1
+#define AUGMENT_ELASTIC_ALPHA 34.0
+#define AUGMENT_ELASTIC_SIGMA 4.0
 
 //#define DROPOUT_RATE 0.2
 
-//#define OPTIMIZE_ADAM
-//#define OPTIMIZE_RMSPROP
-//#define OPTIMIZE_ADAGRAD
-#define OPTIMIZE_NESTEROV
-//#define OPTIMIZE_MOMENTUM
-// default GD
-
-#if defined(OPTIMIZE_ADAM)
-	#define INITIAL_LEARNING_RATE 0.001
-	#define ADAM_BETA1 0.9
-	#define ADAM_BETA2 0.999
-	#define ADAM_EPSILON 1e-8
-#elif defined(OPTIMIZE_RMSPROP)
-	#define	INITIAL_LEARNING_RATE 0.0003
-	#define RMSPROP_RHO 0.99985
-	#define RMSPROP_EPSILON 1e-8
-	#define LEARNING_RATE_DECAY 0.999992
-#elif defined(OPTIMIZE_ADAGRAD)
-	#define	INITIAL_LEARNING_RATE 0.0003
-	#define RMSPROP_EPSILON 1e-8
-#elif defined(OPTIMIZE_NESTEROV)
-	#define INITIAL_LEARNING_RATE 0.004
-	#define NESTEROV_MOMENTUM_FACTOR 0.95
-	#define LEARNING_RATE_DECAY 0.999997
-	#define WEIGHT_DECAY 0.00000006
-#elif defined(OPTIMIZE_MOMENTUM)
-	#define	INITIAL_LEARNING_RATE 0.002
-	#define MOMENTUM_MOMENTUM_FACTOR 0.97
-	#define LEARNING_RATE_DECAY 0.99997
-	#define WEIGHT_DECAY 0.00000006
-#else
-	#define	INITIAL_LEARNING_RATE 0.05
-	#define LEARNING_RATE_DECAY 0.999995
-	#define WEIGHT_DECAY 0.0000001
-#endif
+/* Optimizer used unless another one is chosen at runtime, see `Network::set_optimizer()` */
+#define DEFAULT_OPTIMIZER nn::optimizer::types::Nesterov
 
+/* Hyperparameters of each optimizer. The learning rate is multiplied by *_LEARNING_RATE_DECAY after every update. */
+#define ADAM_LEARNING_RATE 0.001
+#define ADAM_BETA1 0.9
+#define ADAM_BETA2 0.999
+#define ADAM_EPSILON 1e-8
+
+#define RMSPROP_LEARNING_RATE 0.0003
+#define RMSPROP_RHO 0.99985
+#define RMSPROP_EPSILON 1e-8
+#define RMSPROP_LEARNING_RATE_DECAY 0.999992
+
+#define ADAGRAD_LEARNING_RATE 0.0003
+#define ADAGRAD_EPSILON 1e-8
+
+#define NESTEROV_LEARNING_RATE 0.004
+#define NESTEROV_MOMENTUM_FACTOR 0.95
+#define NESTEROV_LEARNING_RATE_DECAY 0.999997
+#define NESTEROV_WEIGHT_DECAY 0.00000006
+
+#define MOMENTUM_LEARNING_RATE 0.002
+#define MOMENTUM_MOMENTUM_FACTOR 0.97
+#define MOMENTUM_LEARNING_RATE_DECAY 0.99997
+#define MOMENTUM_WEIGHT_DECAY 0.00000006
+
+#define GD_LEARNING_RATE 0.05
+#define GD_LEARNING_RATE_DECAY 0.999995
+#define GD_WEIGHT_DECAY 0.0000001
+
+// Overrides the weight decay of every optimizer
 //#define WEIGHT_DECAY (0.000005)
 
+// Applies the weight decay to a scale per layer instead of every weight, and multiplies the weights by it when it falls below this value
+//#define LAZY_WEIGHT_DECAY 0.5
+
 //#define XAVIER_INITIALIZATION
 //#define ZERO_BIAS_INITIALIZATION
 
@@ -1,22 +1,35 @@
 #pragma once
 #include "Config.h"
+#include "Layout.h"
+#include "MappedFile.h"
+#include "Random.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 namespace nn {
+	/** A single labeled sample, stored in scalar type T */
+	template<typename T = NUM_TYPE>
 	struct DataEntry {
-		NUM_TYPE* data;
+		T* data;
 		int data_count;
 
-		NUM_TYPE* label;
+		T* label;
 		int label_count;
 
 		DataEntry() : data(NULL), data_count(0), label(NULL), label_count(0) {}
 
 		DataEntry(int data_size, int label_size)
-			: data(new NUM_TYPE[data_size]), data_count(data_size), label(new NUM_TYPE[label_size]), label_count(label_size)
+			: data(new T[data_size]), data_count(data_size), label(new T[label_size]), label_count(label_size)
 		{}
-		DataEntry(int data_size, NUM_TYPE* data, int label_size, NUM_TYPE* label)
-			: data(new NUM_TYPE[data_size]), data_count(data_size), label(new NUM_TYPE[label_size]), label_count(label_size)
+		DataEntry(int data_size, T* data, int label_size, T* label)
+			: data(new T[data_size]), data_count(data_size), label(new T[label_size]), label_count(label_size)
 		{
 			for (int i = 0; i < data_count; i++)
 				this->data[i] = data[i];
@@ -25,7 +38,7 @@ namespace nn {
 		}
 
 		DataEntry(DataEntry& other)
-			: data(new NUM_TYPE[other.data_count]), data_count(other.data_count), label(new NUM_TYPE[other.label_count]), label_count(other.label_count)
+			: data(new T[other.data_count]), data_count(other.data_count), label(new T[other.label_count]), label_count(other.label_count)
 		{
 			for (int i = 0; i < data_count; i++)
 				data[i] = other.data[i];
@@ -58,11 +71,438 @@ namespace nn {
 
 	};
 
+	/**
+	 * Samples stored compactly, with the inputs as bytes and the labels as class indices.
+	 * The samples are either kept in a single aligned arena of their own, filled by `push_back()`,
+	 * or read in place from a file mapped in memory(see `view()`), with no copy at all.
+	 * A MNIST sample takes 833 bytes in the arena(its 784 inputs padded to 832, and the label), instead of the 6.3 KB of a `DataEntry<double>` in two allocations.
+	 * The inputs are multiplied by `scale()` as they're gathered into a batch, and the labels are expanded to one-hot as the output delta is calculated(see `Network::train()`).
+	 */
+	class SampleSet {
+	public:
+		/**
+		 * Creates an empty set with an arena of its own.
+		 * @param inputs Number of inputs of a sample.
+		 * @param classes Number of classes, the outputs of the network. At most 256.
+		 * @param scale Multiplied to the stored bytes to get the inputs, e.g. 1 / 255.0.
+		 */
+		SampleSet(int inputs, int classes, double scale = 1)
+			: inputs_(inputs), classes_(classes), scale_(scale), arena(NULL), rows(NULL), row_stride(layout::stride<unsigned char>(inputs)),
+			label_bytes(NULL), label_stride(1), label_size(1), shuffled(0), count(0), capacity(0)
+		{
+			assert(classes <= 256);
+		}
+
+		/**
+		 * Creates a set reading `count` samples in place from mapped files, which are kept mapped as long as the set.
+		 * @param rows Inputs of the first sample in `file`, `row_stride` bytes apart.
+		 * @param labels Label of the first sample in `label_file`(which may be `file`), `label_stride` bytes apart, each a byte or a native `int`(`label_size` of 1 or 4).
+		 */
+		static SampleSet view(int inputs, int classes, double scale, size_t count,
+			const std::shared_ptr<MappedFile>& file, const unsigned char* rows, size_t row_stride,
+			const std::shared_ptr<MappedFile>& label_file, const unsigned char* labels, size_t label_stride, int label_size)
+		{
+			assert(label_size == 1 || label_size == 4);
+			SampleSet set(inputs, classes, scale);
+			set.file = file;
+			set.label_file = label_file;
+			set.rows = rows;
+			set.row_stride = row_stride;
+			set.label_bytes = labels;
+			set.label_stride = label_stride;
+			set.label_size = label_size;
+			set.count = set.capacity = count;
+			return set;
+		}
+
+		SampleSet(SampleSet&& other)
+			: arena(NULL)
+		{
+			*this = std::move(other);
+		}
+
+		SampleSet& operator=(SampleSet&& other) {
+			if (this == &other) return *this;
+			layout::release(arena);
+			inputs_ = other.inputs_;
+			classes_ = other.classes_;
+			scale_ = other.scale_;
+			arena = other.arena;
+			labels = std::move(other.labels);
+			file = std::move(other.file);
+			label_file = std::move(other.label_file);
+			rows = other.rows;
+			row_stride = other.row_stride;
+			label_bytes = arena ? labels.data() : other.label_bytes;
+			label_stride = other.label_stride;
+			label_size = other.label_size;
+			order = std::move(other.order);
+			next_order = std::move(other.next_order);
+			shuffled = other.shuffled;
+			count = other.count;
+			capacity = other.capacity;
+
+			other.arena = NULL;
+			other.rows = other.label_bytes = NULL;
+			other.count = other.capacity = 0;
+			return *this;
+		}
+
+		~SampleSet() {
+			layout::release(arena);
+		}
+
+		int inputs() const { return inputs_; }
+		int classes() const { return classes_; }
+		double scale() const { return scale_; }
+		size_t size() const { return count; }
+		/** Whether the samples are read in place from a mapped file, instead of an arena of its own. */
+		bool mapped() const { return (bool) file; }
+
+		/** Stored inputs of sample `i`, `inputs()` bytes. On a 64-byte boundary in the arena, but not necessarily in a mapped file. */
+		const unsigned char* data(size_t i) const {
+			assert(i < count);
+			return rows + position(i) * row_stride;
+		}
+		/** Class index of sample `i`. */
+		int label(size_t i) const {
+			assert(i < count);
+			const unsigned char* p = label_bytes + position(i) * label_stride;
+			if (label_size == 1) return *p;
+
+			int label;
+			memcpy(&label, p, sizeof(label));
+			return label;
+		}
+
+		/** Grows the arena to hold `n` samples without moving. Only for a set of its own. */
+		void reserve(size_t n) {
+			assert(!file);
+			if (n <= capacity) return;
+
+			unsigned char* grown = layout::allocate<unsigned char>(n * row_stride);
+			if (count > 0) memcpy(grown, arena, count * row_stride);
+			layout::release(arena);
+			arena = grown;
+			rows = arena;
+			labels.reserve(n);
+			label_bytes = labels.data();
+			capacity = n;
+		}
+
+		/**
+		 * Appends a sample, doubling the arena when it's full. Only for a set of its own.
+		 * @param data `inputs()` bytes.
+		 * @param label Class index, below `classes()`.
+		 */
+		void push_back(const unsigned char* data, int label) {
+			assert(label >= 0 && label < classes_);
+			if (count == capacity) reserve(capacity > 0 ? capacity * 2 : 1024);
+			memcpy(arena + count * row_stride, data, inputs_);
+			labels.push_back((unsigned char) label);
+			if (!order.empty()) order.push_back((unsigned int) count);
+			count++;
+		}
+
+		/**
+		 * Resizes the set to `n` samples, the new ones zero-filled with label 0, to be written in place by `row()` and `set_label()`.
+		 * Only for a set of its own, before it's shuffled.
+		 */
+		void resize(size_t n) {
+			assert(!file && order.empty());
+			reserve(n);
+			if (n > count) memset(arena + count * row_stride, 0, (n - count) * row_stride);
+			labels.resize(n);
+			label_bytes = labels.data();
+			count = n;
+		}
+
+		/** Stored inputs of sample `i` to write, see `resize()`. Different samples can be written from different threads. */
+		unsigned char* row(size_t i) {
+			assert(!file && order.empty() && i < count);
+			return arena + i * row_stride;
+		}
+
+		void set_label(size_t i, int label) {
+			assert(!file && order.empty() && i < count && label >= 0 && label < classes_);
+			labels[i] = (unsigned char) label;
+		}
+
+		/** Removes all the samples, keeping the arena to fill again. Only for a set of its own. */
+		void clear() {
+			assert(!file);
+			labels.clear();
+			order.clear();
+			count = 0;
+		}
+
+		/**
+		 * Shuffles the samples with the generator of the calling thread.
+		 * Only a permutation of the indices is shuffled, and the samples are read through it, so no sample is moved whether in the arena or a mapped file.
+		 * The permutation is drawn ahead by `shuffle_ahead()`, and only its rest is drawn here.
+		 */
+		void shuffle() {
+			shuffle_ahead(count);
+			order.swap(next_order);
+			/* The last order is shuffled again for the next one, which is as random as shuffling the identity */
+			shuffled = 0;
+		}
+
+		/**
+		 * Draws the next `n` swaps of the permutation the next `shuffle()` switches to, while the samples are still read in the current order.
+		 * Called between the batches, it spreads the work of a shuffle over the pass instead of stopping at its end.
+		 */
+		void shuffle_ahead(size_t n) {
+			if (next_order.size() != count) {
+				next_order.resize(count);
+				for (size_t i = 0; i < count; i++) next_order[i] = (unsigned int) i;
+				shuffled = 0;
+			}
+			/* Fisher-Yates, from the last index down */
+			Random& random = Random::local();
+			for (; n > 0 && shuffled + 1 < count; n--, shuffled++) {
+				const size_t i = count - shuffled;
+				std::swap(next_order[i - 1], next_order[random.below(i)]);
+			}
+		}
+
+	private:
+		int inputs_, classes_;
+		double scale_;
+		/* [capacity x row_stride] bytes of a set of its own, and its labels */
+		unsigned char* arena;
+		std::vector<unsigned char> labels;
+		/* Files the samples and their labels are read from, if mapped */
+		std::shared_ptr<MappedFile> file, label_file;
+		/* First row and label, in the arena or the file */
+		const unsigned char* rows;
+		size_t row_stride;
+		const unsigned char* label_bytes;
+		size_t label_stride;
+		int label_size;
+		/* Shuffled order of the samples, identity if empty, and the next one with its first `shuffled` swaps drawn */
+		std::vector<unsigned int> order, next_order;
+		size_t shuffled;
+		size_t count, capacity;
+
+		size_t position(size_t i) const {
+			return order.empty() ? i : order[i];
+		}
+
+		SampleSet(const SampleSet&);
+		SampleSet& operator=(const SampleSet&);
+	};
+
+	/** Expands the samples into `DataEntry`s in T, for the datasets read as `SampleSet`s. */
+	template<typename T>
+	std::vector<DataEntry<T>> to_entries(const SampleSet& samples) {
+		std::vector<DataEntry<T>> entries;
+		entries.reserve(samples.size());
+		for (size_t s = 0; s < samples.size(); s++) {
+			DataEntry<T> entry(samples.inputs(), samples.classes());
+			const unsigned char* data = samples.data(s);
+			for (int i = 0; i < samples.inputs(); i++) {
+				entry.data[i] = (T) (data[i] * samples.scale());
+			}
+			for (int i = 0; i < samples.classes(); i++) {
+				entry.label[i] = (samples.label(s) == i) ? 1 : 0;
+			}
+			entries.push_back(std::move(entry));
+		}
+		return entries;
+	}
+
+	/**
+	 * A batch of samples gathered ahead of the training(see `Prefetcher`), in the storage type S of the network it's trained on:
+	 * the inputs scaled into padded, aligned rows as the network reads them, and the labels as class indices.
+	 */
+	template<typename S>
+	struct Minibatch {
+		const int inputs;
+		const int stride;
+		/* [capacity x stride] */
+		S* const data;
+		std::vector<unsigned char> labels;
+		/* Samples held, at most the capacity */
+		unsigned int size;
+
+		Minibatch(int inputs, unsigned int capacity)
+			: inputs(inputs), stride(layout::stride<S>(inputs)), data(layout::allocate<S>((size_t) capacity * stride)), labels(capacity), size(0)
+		{}
+
+		~Minibatch() {
+			layout::release(data);
+		}
+
+		const S* row(unsigned int i) const {
+			return data + (size_t) i * stride;
+		}
+
+	private:
+		Minibatch(const Minibatch&);
+		Minibatch& operator=(const Minibatch&);
+	};
+
+	/**
+	 * Train samples read one pass after another from a list of files too large to be held in memory, in fixed-size records.
+	 * The samples are shuffled in two levels: the files are read in a new random order on every pass,
+	 * and the samples read go through a buffer which the next sample is drawn from at random, to be replaced by the one read after.
+	 * Only the buffer and a chunk of the current file are held, so the memory is bounded by `buffer_size()` whatever the number of samples,
+	 * and the samples are mixed well as long as the buffer is larger than a file.
+	 */
+	class SampleStream {
+	public:
+		/* Records read from a file at a time */
+		static const size_t CHUNK_RECORDS = 1024;
+
+		/**
+		 * @param paths Files of `record_size`-byte records, each holding the `inputs` bytes of a sample at `data_offset`,
+		 *              and its class index at `label_offset`, a byte or a native `int`(`label_size` of 1 or 4).
+		 * @param scale Multiplied to the stored bytes to get the inputs, see `SampleSet`.
+		 * @param buffer_size Samples held to shuffle.
+		 * @throws std::runtime_error if a file cannot be opened, or is not a whole number of records.
+		 */
+		SampleStream(const std::vector<std::string>& paths, int inputs, int classes, double scale,
+			size_t record_size, size_t data_offset, size_t label_offset, int label_size, size_t buffer_size)
+			: paths(paths), inputs_(inputs), classes_(classes), scale_(scale),
+			record_size(record_size), data_offset(data_offset), label_offset(label_offset), label_size(label_size),
+			total(0), next_file(0), chunk(CHUNK_RECORDS * record_size), chunk_count(0), chunk_position(0),
+			buffer_size_(buffer_size > 0 ? buffer_size : 1), buffer_rows(buffer_size_ * inputs), buffer_labels(buffer_size_), held(0)
+		{
+			assert(label_size == 1 || label_size == 4);
+			for (size_t f = 0; f < paths.size(); f++) {
+				std::ifstream is(paths[f].c_str(), std::ios::binary | std::ios::ate);
+				if (is.fail()) throw std::runtime_error("Cannot open " + paths[f]);
+				const size_t size = (size_t) is.tellg();
+				if (size % record_size != 0) throw std::runtime_error(paths[f] + " is not a whole number of records");
+				total += size / record_size;
+				order.push_back(f);
+			}
+			rewind();
+		}
+
+		int inputs() const { return inputs_; }
+		int classes() const { return classes_; }
+		double scale() const { return scale_; }
+		/** Samples in a pass. */
+		size_t size() const { return total; }
+		size_t files() const { return paths.size(); }
+		size_t buffer_size() const { return buffer_size_; }
+
+		/**
+		 * Replaces the samples of `samples` with the next `n` ones of the pass, or as many as are left.
+		 * `samples` is made a set of its own in the format of the stream if it isn't, and its arena is reused otherwise.
+		 * @throws std::runtime_error if a file cannot be read, or holds an invalid label.
+		 * @returns The number of samples read, less than `n` only at the end of the pass.
+		 */
+		size_t next(SampleSet& samples, size_t n) {
+			if (samples.mapped() || samples.inputs() != inputs_ || samples.classes() != classes_ || samples.scale() != scale_) {
+				samples = SampleSet(inputs_, classes_, scale_);
+			}
+			samples.clear();
+			samples.reserve(n);
+			while (samples.size() < n && held > 0) {
+				const size_t j = (size_t) Random::local().below(held);
+				unsigned char* row = &buffer_rows[j * inputs_];
+				samples.push_back(row, buffer_labels[j]);
+				if (!read(row, buffer_labels[j])) {
+					/* The files are over, so the buffer drains */
+					held--;
+					memcpy(row, &buffer_rows[held * inputs_], inputs_);
+					buffer_labels[j] = buffer_labels[held];
+				}
+			}
+			return samples.size();
+		}
+
+		/** Starts a new pass, reading the files in a new random order. */
+		void rewind() {
+			Random& random = Random::local();
+			for (size_t i = order.size(); i > 1; i--) {
+				std::swap(order[i - 1], order[random.below(i)]);
+			}
+			next_file = 0;
+			current.close();
+			current.clear();
+			chunk_count = chunk_position = 0;
+
+			held = 0;
+			while (held < buffer_size_ && read(&buffer_rows[held * inputs_], buffer_labels[held])) {
+				held++;
+			}
+		}
+
+	private:
+		const std::vector<std::string> paths;
+		const int inputs_, classes_;
+		const double scale_;
+		const size_t record_size, data_offset, label_offset;
+		const int label_size;
+		size_t total;
+
+		/* Files of the pass in the order read, and the one being read */
+		std::vector<size_t> order;
+		size_t next_file;
+		std::ifstream current;
+		/* Records read from the current file, and the next one to take */
+		std::vector<unsigned char> chunk;
+		size_t chunk_count, chunk_position;
+
+		/* The shuffle buffer, `held` samples of inputs and labels */
+		const size_t buffer_size_;
+		std::vector<unsigned char> buffer_rows, buffer_labels;
+		size_t held;
+
+		/* Reads the next record of the pass into `row` and `label`, or returns false at the end */
+		bool read(unsigned char* row, unsigned char& label) {
+			while (chunk_position == chunk_count) {
+				if (current.is_open()) {
+					current.read(reinterpret_cast<char*>(&chunk[0]), chunk.size());
+					chunk_count = (size_t) current.gcount() / record_size;
+					chunk_position = 0;
+					if (chunk_count > 0) break;
+					current.close();
+					current.clear();
+				}
+				if (next_file == order.size()) return false;
+				const std::string& path = paths[order[next_file++]];
+				current.open(path.c_str(), std::ios::binary);
+				if (current.fail()) throw std::runtime_error("Cannot open " + path);
+			}
+
+			const unsigned char* record = &chunk[chunk_position++ * record_size];
+			memcpy(row, record + data_offset, inputs_);
+			int value = record[label_offset];
+			if (label_size == 4) memcpy(&value, record + label_offset, sizeof(value));
+			if (value < 0 || value >= classes_) throw std::runtime_error("Invalid label in " + paths[order[next_file - 1]]);
+			label = (unsigned char) value;
+			return true;
+		}
+
+		SampleStream(const SampleStream&);
+		SampleStream& operator=(const SampleStream&);
+	};
+
+	template<typename T = NUM_TYPE>
 	class Dataset {
 	public:
 		virtual ~Dataset() {}
 
-		virtual std::vector<DataEntry> get_train_set() = 0;
-		virtual std::vector<DataEntry> get_test_set() = 0;
+		virtual std::vector<DataEntry<T>> get_train_set() = 0;
+		virtual std::vector<DataEntry<T>> get_test_set() = 0;
+
+		/** The train and test sets as compact `SampleSet`s, instead of a `DataEntry` per sample. */
+		virtual SampleSet get_train_samples() = 0;
+		virtual SampleSet get_test_samples() = 0;
+
+		/**
+		 * Opens the train set as a `SampleStream`, for the sets read in passes instead of whole.
+		 * @param buffer_size Samples held to shuffle, see `SampleStream`.
+		 * @returns The stream, or NULL if the set is only read whole by `get_train_samples()`.
+		 */
+		virtual std::unique_ptr<SampleStream> open_train_stream(size_t buffer_size) {
+			(void) buffer_size;
+			return std::unique_ptr<SampleStream>();
+		}
 	};
 }
\ No newline at end of file
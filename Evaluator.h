@@ -0,0 +1,211 @@
+#pragma once
+
+/**
+ * Evaluation of a network over a whole `SampleSet`, e.g. the test set between the epochs.
+ * The samples are predicted a batch at a time through `Network::predict_batch()`, which runs on all the threads of the network,
+ * and the MSE, the accuracy and the confusion matrix are summed up from the outputs of each batch in the same pass.
+ * `AsyncEvaluator` evaluates a copy of the weights of a training network on a thread of its own instead, so the training goes on meanwhile.
+ */
+
+#include "Config.h"
+#include "Dataset.h"
+#include "Network.h"
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nn {
+	/** Errors of a network over a set of samples, see `Evaluator` */
+	struct Evaluation {
+		int classes;
+		size_t count;
+		/* Squared errors against the one-hot labels, summed up over the samples and the outputs */
+		double sq_error;
+		size_t correct;
+		/* Row-major [classes x classes], the samples of each label(row) predicted as each class(column) */
+		std::vector<size_t> confusion;
+
+		explicit Evaluation(int classes) : classes(classes), count(0), sq_error(0), correct(0), confusion((size_t) classes * classes, 0) {}
+
+		/** NaN for no samples, so an empty set never passes a threshold */
+		double mse() const {
+			return count > 0 ? sq_error / ((double) count * classes) : std::numeric_limits<double>::quiet_NaN();
+		}
+		/** Ratio of the samples predicted right, 0~1, or NaN for no samples */
+		double accuracy() const {
+			return count > 0 ? (double) correct / count : std::numeric_limits<double>::quiet_NaN();
+		}
+		size_t at(int label, int predicted) const {
+			return confusion[(size_t) label * classes + predicted];
+		}
+		/** Ratio of the samples predicted as class `c` which are labeled `c`, or 0 if none was predicted as `c`. */
+		double precision(int c) const {
+			size_t predicted = 0;
+			for (int l = 0; l < classes; l++) predicted += at(l, c);
+			return predicted > 0 ? (double) at(c, c) / predicted : 0;
+		}
+		/** Ratio of the samples labeled `c` which are predicted as `c`, or 0 if none is labeled `c`. */
+		double recall(int c) const {
+			size_t labeled = 0;
+			for (int p = 0; p < classes; p++) labeled += at(c, p);
+			return labeled > 0 ? (double) at(c, c) / labeled : 0;
+		}
+	};
+
+	template<typename T, typename S = T>
+	class Evaluator {
+	public:
+		/**
+		 * @param network Kept by the caller. Its batch buffers are overwritten by every evaluation, so it must not be trained at the same time.
+		 * @param batch_size Samples predicted at a time.
+		 */
+		explicit Evaluator(Network<T, S>& network, unsigned int batch_size = EVALUATE_BATCH)
+			: network(network), batch_size(std::max(batch_size, 1u)), results((size_t) std::max(batch_size, 1u) * network.outputs) {}
+
+		/** The predicted class is the output with the largest value, the first one of a tie. */
+		Evaluation evaluate(const SampleSet& samples) {
+			const int classes = network.outputs;
+			assert(samples.classes() == classes);
+			Evaluation result(classes);
+			for (size_t begin = 0; begin < samples.size(); begin += batch_size) {
+				const unsigned int n = (unsigned int) std::min((size_t) batch_size, samples.size() - begin);
+				network.predict_batch(n, samples, begin, &results[0]);
+
+				for (unsigned int i = 0; i < n; i++) {
+					const T* output = &results[(size_t) i * classes];
+					const int label = samples.label(begin + i);
+					int predicted = 0;
+					for (int j = 0; j < classes; j++) {
+						if (output[j] > output[predicted]) predicted = j;
+
+						const double error = output[j] - (j == label ? 1 : 0);
+						result.sq_error += error * error;
+					}
+					result.confusion[(size_t) label * classes + predicted]++;
+					if (predicted == label) result.correct++;
+				}
+				result.count += n;
+			}
+			return result;
+		}
+
+	private:
+		Network<T, S>& network;
+		const unsigned int batch_size;
+		/* Results of a batch, [batch_size x classes] */
+		std::vector<T> results;
+	};
+
+	/**
+	 * Evaluates snapshots of the weights of a network on a thread of its own, while the network keeps training.
+	 * A snapshot is a copy of the weights into a clone of the network, taken on the training thread between the updates,
+	 * which costs a pass over the weights instead of a pass of the whole set through them.
+	 * One snapshot is evaluated at a time, and its result is kept with the tag given to `start()` until it's taken by `poll()`.
+	 */
+	template<typename T, typename S = T>
+	class AsyncEvaluator {
+	public:
+		/**
+		 * @param network Kept by the caller, only read by `start()`.
+		 * @param samples Kept by the caller, and must not change until the evaluator is destroyed.
+		 * @param threads Threads evaluating a snapshot, including the evaluator's own. They're taken from the training, so the default is the evaluator's alone.
+		 */
+		AsyncEvaluator(Network<T, S>& network, const SampleSet& samples, int threads = 1)
+			: network(network), samples(samples), snapshot(network.clone(threads)), evaluator(*snapshot),
+			running(false), done(false), stop(false), snapshot_tag(0), result_tag(0), result(network.outputs)
+		{
+			worker = std::thread(&AsyncEvaluator::run, this);
+		}
+
+		/** Waits for the evaluation running, if any, to finish. */
+		~AsyncEvaluator() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+			}
+			cv.notify_all();
+			worker.join();
+		}
+
+		/**
+		 * Takes a snapshot of the weights of the network and starts evaluating it. Called on the thread training the network, between the updates.
+		 * @param tag Given back with the result, e.g. the epoch of the weights.
+		 * @returns false without a snapshot if the last one is still being evaluated.
+		 */
+		bool start(int tag) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (running) return false;
+			snapshot->copy_weights(network);
+			snapshot_tag = tag;
+			running = true;
+			cv.notify_all();
+			return true;
+		}
+
+		/**
+		 * Takes the result of the last evaluation finished, if not taken yet.
+		 * @returns false if there's no new result.
+		 */
+		bool poll(int& tag, Evaluation& result) {
+			std::lock_guard<std::mutex> lock(mutex);
+			return take(tag, result);
+		}
+
+		/** Waits for the evaluation running, if any, then `poll()`s. */
+		bool wait(int& tag, Evaluation& result) {
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this] { return !running; });
+			return take(tag, result);
+		}
+
+	private:
+		Network<T, S>& network;
+		const SampleSet& samples;
+		const std::unique_ptr<Network<T, S>> snapshot;
+		Evaluator<T, S> evaluator;
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		/* A snapshot is being evaluated, and a result is waiting for `poll()`, under the mutex */
+		bool running, done, stop;
+		/* Tags of the snapshot being evaluated and of the result */
+		int snapshot_tag, result_tag;
+		Evaluation result;
+		std::thread worker;
+
+		bool take(int& tag, Evaluation& result) {
+			if (!done) return false;
+			tag = result_tag;
+			result = this->result;
+			done = false;
+			return true;
+		}
+
+		void run() {
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true) {
+				cv.wait(lock, [this] { return running || stop; });
+				if (stop) return;
+
+				/* The snapshot is left alone by `start()` as long as it's running */
+				lock.unlock();
+				Evaluation evaluation = evaluator.evaluate(samples);
+				lock.lock();
+
+				result = evaluation;
+				result_tag = snapshot_tag;
+				done = true;
+				running = false;
+				cv.notify_all();
+			}
+		}
+
+		AsyncEvaluator(const AsyncEvaluator&);
+		AsyncEvaluator& operator=(const AsyncEvaluator&);
+	};
+}
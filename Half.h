@@ -0,0 +1,103 @@
+#pragma once
+
+/**
+ * 16-bit floating point storage types, used for the mixed precision mode.
+ * Arithmetic is never done in these types; they are converted to float on load, and back on store.
+ * The conversions here are the portable(software) ones; `Simd.h` has the vectorized versions.
+ */
+
+#include <cstring>
+
+namespace nn {
+	/** bfloat16, the upper half of a float32. Conversion from float rounds to the nearest even. */
+	struct bf16 {
+		unsigned short bits;
+
+		bf16() {}
+		explicit bf16(float f) : bits(from_float(f)) {}
+
+		operator float() const {
+			unsigned int u = (unsigned int) bits << 16;
+			float f;
+			memcpy(&f, &u, sizeof(f));
+			return f;
+		}
+
+		static unsigned short from_float(float f) {
+			unsigned int u;
+			memcpy(&u, &f, sizeof(u));
+			/* Keep NaN quiet, instead of rounding it to infinity */
+			if ((u & 0x7fffffffu) > 0x7f800000u) return (unsigned short) ((u >> 16) | 0x40);
+			u += 0x7fffu + ((u >> 16) & 1);
+			return (unsigned short) (u >> 16);
+		}
+	};
+
+	/** IEEE 754 binary16. Conversion from float rounds to the nearest even. */
+	struct fp16 {
+		unsigned short bits;
+
+		fp16() {}
+		explicit fp16(float f) : bits(from_float(f)) {}
+
+		operator float() const {
+			const unsigned int sign = (unsigned int) (bits & 0x8000) << 16;
+			unsigned int exp = (bits >> 10) & 0x1f;
+			unsigned int mant = bits & 0x3ff;
+			unsigned int u;
+
+			if (exp == 0x1f) {
+				/* Inf, NaN */
+				u = sign | 0x7f800000u | (mant << 13);
+			} else if (exp == 0) {
+				if (mant == 0) {
+					u = sign;
+				} else {
+					/* Subnormal, normalized as a float */
+					exp = 127 - 15 + 1;
+					while (!(mant & 0x400)) {
+						mant <<= 1;
+						exp--;
+					}
+					u = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+				}
+			} else {
+				u = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+			}
+
+			float f;
+			memcpy(&f, &u, sizeof(f));
+			return f;
+		}
+
+		static unsigned short from_float(float f) {
+			unsigned int u;
+			memcpy(&u, &f, sizeof(u));
+			const unsigned short sign = (unsigned short) ((u >> 16) & 0x8000);
+			u &= 0x7fffffffu;
+
+			/* Inf, NaN */
+			if (u >= 0x7f800000u) return sign | 0x7c00 | ((u > 0x7f800000u) ? 0x200 : 0);
+			/* 65520 and above round to infinity */
+			if (u >= 0x477ff000u) return sign | 0x7c00;
+			/* Below 2^-14, a subnormal half */
+			if (u < 0x38800000u) {
+				/* 2^-25 and below round to zero */
+				if (u <= 0x33000000u) return sign;
+
+				const unsigned int exp = u >> 23;
+				const unsigned int mant = (u & 0x7fffff) | 0x800000;
+				const unsigned int shift = 126 - exp;
+				unsigned int r = mant >> shift;
+				const unsigned int rem = mant & ((1u << shift) - 1), half = 1u << (shift - 1);
+				if (rem > half || (rem == half && (r & 1))) r++;
+				return sign | (unsigned short) r;
+			}
+
+			/* Round at bit 13, then rebias the exponent from 127 to 15 */
+			u += 0xfffu + ((u >> 13) & 1);
+			u -= (127 - 15) << 23;
+			return sign | (unsigned short) (u >> 13);
+		}
+	};
+}
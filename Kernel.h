@@ -0,0 +1,501 @@
+#pragma once
+
+/**
+ * Dense matrix kernels used by the layers.
+ * All matrices are row-major, and `ld*` is the distance(in elements) between two consecutive rows.
+ * The loops are blocked so a tile of the right-hand matrix(the weights, usually) stays in cache while every row of the left-hand matrix(the minibatch) is streamed through it.
+ * The innermost loops are dispatched through `ops()`, a table of the vectorized kernels for the best instruction set supported by the running CPU.
+ * The GEMMs split their blocks over the threads of `pool`, as many as the size of the product is worth(see `ThreadPool::plan()`). NULL runs them on the calling thread.
+ */
+
+#include "Config.h"
+#include "Simd.h"
+#include "ThreadPool.h"
+#include <algorithm>
+
+#ifdef NN_SIMD_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace nn {
+	namespace kernel {
+		/**
+		 * Hyperparameters of a single optimizer update.
+		 * `beta1` is the momentum factor of Momentum/Nesterov and Adam's first moment decay, `beta2` is RMSProp's rho and Adam's second moment decay.
+		 */
+		template<typename T>
+		struct UpdateParams {
+			T scale;   // Multiplied to the gradient array to get the loss, e.g. 1 / batch size
+			T lr;      // Learning rate, already bias-corrected for Adam
+			T decay;   // Weight decay, 0 to disable
+			T beta1, beta2;
+			T epsilon;
+			T inv_scale; // Multiplied to the difference of the weights, 1 / the scale of the stored weights with `LAZY_WEIGHT_DECAY`
+		};
+
+		/** Builds the parameters with `scale` and `inv_scale` = 1, converting the (double) hyperparameters to T. */
+		template<typename T>
+		inline UpdateParams<T> update_params(double lr, double decay, double beta1 = 0, double beta2 = 0, double epsilon = 0) {
+			UpdateParams<T> p = { 1, (T) lr, (T) decay, (T) beta1, (T) beta2, (T) epsilon, 1 };
+			return p;
+		}
+
+		/**
+		 * Constants of the vectorized exp.
+		 * x is reduced to x = n * ln2 + r with |r| <= ln2 / 2, and exp(x) = 2^n * P(r) where P is the Taylor series of exp to `degree`.
+		 * ln2 is split into hi + lo, with the low bits of hi zero so n * hi is exact(Cody-Waite reduction).
+		 * The truncation error of P is below r^(degree+1) / (degree+1)! = 4.2e-18 for double, 5.2e-9 for float, a fraction of an ulp.
+		 * Measured over the whole range, exp is within 2 ulp(relative) of libm, and sigmoid/tanh are within 2 ulp of 1(absolute).
+		 * x is clamped to [lo, hi] so 2^n stays a normal number; exp of smaller inputs returns about 1e-308(1e-38 for float) instead of 0.
+		 */
+		template<typename T> struct ExpConsts;
+		template<> struct ExpConsts<double> {
+			static const int degree = 13;
+			static double lo() { return -708.3; }
+			static double hi() { return 709.0; }
+			static double log2e() { return 1.4426950408889634; }
+			static double ln2_hi() { return 6.93145751953125e-1; }
+			static double ln2_lo() { return 1.42860682030941723212e-6; }
+			/* Adding and subtracting 1.5 * 2^52 rounds to the nearest integer */
+			static double round_magic() { return 6755399441055744.0; }
+			/* 1 / k! */
+			static double coef(int k) {
+				static const double c[] = {
+					1.0, 1.0, 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 120, 1.0 / 720, 1.0 / 5040, 1.0 / 40320,
+					1.0 / 362880, 1.0 / 3628800, 1.0 / 39916800, 1.0 / 479001600, 1.0 / 6227020800.0
+				};
+				return c[k];
+			}
+		};
+		template<> struct ExpConsts<float> {
+			static const int degree = 7;
+			static float lo() { return -87.3f; }
+			static float hi() { return 88.0f; }
+			static float log2e() { return 1.44269504f; }
+			static float ln2_hi() { return 0.693359375f; }
+			static float ln2_lo() { return -2.12194440e-4f; }
+			static float round_magic() { return 12582912.0f; }
+			static float coef(int k) {
+				static const float c[] = { 1.0f, 1.0f, 1.0f / 2, 1.0f / 6, 1.0f / 24, 1.0f / 120, 1.0f / 720, 1.0f / 5040 };
+				return c[k];
+			}
+		};
+
+		/**
+		 * Table of kernels compiled for a single instruction set.
+		 * T is the arithmetic type, and S is the storage type of the weights and activations read by the kernels.
+		 * The optimizer updates work on the T master weights only.
+		 */
+		template<typename T, typename S = T>
+		struct Ops {
+			typedef void (*UpdateKernel)(int n, T* w, T* s0, T* s1, const T* g, const UpdateParams<T>& p);
+
+			int isa;
+			T (*dot)(const S* a, const S* b, int n);
+			void (*dot4)(const S* a0, const S* a1, const S* a2, const S* a3, const S* b, int n, T* out);
+			void (*axpy)(int n, T alpha, const S* x, T* y);
+			void (*narrow)(int n, const T* in, S* out);
+			void (*widen)(int n, const S* in, T* out);
+			/* out[i] = scale * in[i], for the inputs stored as bytes(see `SampleSet`) */
+			void (*dequantize)(int n, const unsigned char* in, T scale, S* out);
+			/* Bilinear sampling of a bordered image at n points, see `Augmenter` */
+			void (*bilinear)(int n, const T* image, int width, int height, const T* x, const T* y, T* out);
+
+			/* out[i] = f(in[i]) with the vectorized exp, see `ExpConsts`. `in` and `out` may be the same array. */
+			void (*exp)(int n, const T* in, T* out);
+			void (*sigmoid)(int n, const T* in, T* out);
+			void (*tanh)(int n, const T* in, T* out);
+
+			UpdateKernel sgd_update;
+			UpdateKernel momentum_update;
+			UpdateKernel nesterov_update;
+			UpdateKernel adagrad_update;
+			UpdateKernel rmsprop_update;
+			UpdateKernel adam_update;
+		};
+	}
+}
+
+#define NN_KERNEL_ISA scalar
+#include "KernelImpl.h"
+#undef NN_KERNEL_ISA
+
+#ifdef NN_SIMD_X86
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("sse2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#define NN_KERNEL_ISA sse2
+#include "KernelImpl.h"
+#undef NN_KERNEL_ISA
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2,fma,f16c"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2,fma,f16c")
+#endif
+#define NN_KERNEL_ISA avx2
+#include "KernelImpl.h"
+#undef NN_KERNEL_ISA
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+/* avx512fintrin.h of GCC fills the unused lanes with `_mm512_undefined_*()`, which warns as uninitialized once inlined into the helpers of Simd.h */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f,avx2,fma,f16c"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma,f16c")
+#endif
+#define NN_KERNEL_ISA avx512
+#include "KernelImpl.h"
+#undef NN_KERNEL_ISA
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+/* AVX512_BF16 has a native float to bf16 conversion, used for `narrow` when the CPU has it. Not available with MSVC. */
+#if (defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 10) || (defined(__clang__) && __clang_major__ >= 9)
+#define NN_KERNEL_AVX512BF16
+
+namespace nn {
+	namespace kernel {
+		namespace avx512bf16 {
+			__attribute__((target("avx512bf16,avx512f")))
+			inline void narrow(int n, const float* in, bf16* out) {
+				int i = 0;
+				for (; i + 16 <= n; i += 16) {
+					__m256bh h = _mm512_cvtneps_pbh(_mm512_loadu_ps(in + i));
+					_mm256_storeu_si256((__m256i*) (out + i), (__m256i) h);
+				}
+				for (; i < n; i++) {
+					out[i] = bf16(in[i]);
+				}
+			}
+		}
+	}
+}
+#endif
+
+#endif /* NN_SIMD_X86 */
+
+namespace nn {
+	namespace kernel {
+		namespace isa = simd::isa;
+
+#ifdef NN_SIMD_X86
+		inline void cpuid(int leaf, int subleaf, unsigned int regs[4]) {
+#ifdef _MSC_VER
+			int r[4];
+			__cpuidex(r, leaf, subleaf);
+			for (int i = 0; i < 4; i++) regs[i] = (unsigned int) r[i];
+#else
+			__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+		}
+
+		/* The register state enabled by the OS, XCR0 */
+		inline unsigned long long xgetbv0() {
+#ifdef _MSC_VER
+			return _xgetbv(0);
+#else
+			unsigned int lo, hi;
+			__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+			return ((unsigned long long) hi << 32) | lo;
+#endif
+		}
+#endif
+
+		/**
+		 * Detects the best instruction set usable on this CPU and OS.
+		 */
+		inline int detect_isa() {
+#ifdef NN_SIMD_X86
+			unsigned int r[4];
+			cpuid(0, 0, r);
+			const unsigned int max_leaf = r[0];
+
+			cpuid(1, 0, r);
+			const bool sse2 = (r[3] & (1u << 26)) != 0;
+			const bool osxsave = (r[2] & (1u << 27)) != 0;
+			const bool avx = (r[2] & (1u << 28)) != 0;
+			const bool fma = (r[2] & (1u << 12)) != 0;
+			const bool f16c = (r[2] & (1u << 29)) != 0;
+			if (!sse2) return isa::Scalar;
+			if (!osxsave || !avx || !fma || !f16c || max_leaf < 7) return isa::SSE2;
+
+			const unsigned long long xcr0 = xgetbv0();
+			/* XMM and YMM states */
+			if ((xcr0 & 0x6) != 0x6) return isa::SSE2;
+
+			cpuid(7, 0, r);
+			const bool avx2 = (r[1] & (1u << 5)) != 0;
+			const bool avx512f = (r[1] & (1u << 16)) != 0;
+			if (!avx2) return isa::SSE2;
+			/* opmask, upper ZMM0-15 and ZMM16-31 states */
+			if (!avx512f || (xcr0 & 0xE0) != 0xE0) return isa::AVX2;
+			return isa::AVX512;
+#else
+			return isa::Scalar;
+#endif
+		}
+
+		/** Whether the CPU converts float to bf16 natively(AVX512_BF16) */
+		inline bool has_avx512bf16() {
+#ifdef NN_SIMD_X86
+			unsigned int r[4];
+			cpuid(0, 0, r);
+			if (r[0] < 7) return false;
+			cpuid(7, 0, r);
+			if (r[0] < 1) return false;
+			cpuid(7, 1, r);
+			return (r[0] & (1u << 5)) != 0;
+#else
+			return false;
+#endif
+		}
+
+		inline const char* isa_name(int id) {
+			switch (id) {
+			case isa::SSE2: return "SSE2";
+			case isa::AVX2: return "AVX2";
+			case isa::AVX512: return "AVX-512";
+			default: return "scalar";
+			}
+		}
+
+		template<typename T, typename S>
+		Ops<T, S> make_ops(int id) {
+			Ops<T, S> table;
+			switch (id) {
+#ifdef NN_SIMD_X86
+			case isa::AVX512: avx512::fill(table); break;
+			case isa::AVX2: avx2::fill(table); break;
+			case isa::SSE2: sse2::fill(table); break;
+#endif
+			default: id = isa::Scalar; scalar::fill(table); break;
+			}
+			table.isa = id;
+			return table;
+		}
+
+		template<typename T>
+		Ops<T> make_ops(int id) {
+			return make_ops<T, T>(id);
+		}
+
+#ifdef NN_KERNEL_AVX512BF16
+		template<>
+		inline Ops<float, bf16> make_ops<float, bf16>(int id) {
+			Ops<float, bf16> table;
+			switch (id) {
+			case isa::AVX512: avx512::fill(table); break;
+			case isa::AVX2: avx2::fill(table); break;
+			case isa::SSE2: sse2::fill(table); break;
+			default: id = isa::Scalar; scalar::fill(table); break;
+			}
+			table.isa = id;
+			if (id == isa::AVX512 && has_avx512bf16()) {
+				table.narrow = &avx512bf16::narrow;
+			}
+			return table;
+		}
+#endif
+
+		/* Kernel table in use, picked on the first call */
+		template<typename T, typename S>
+		Ops<T, S>& current_ops() {
+			static Ops<T, S> table = make_ops<T, S>(detect_isa());
+			return table;
+		}
+
+		/**
+		 * Returns the kernels for the instruction set in use.
+		 */
+		template<typename T, typename S = T>
+		inline const Ops<T, S>& ops() {
+			return current_ops<T, S>();
+		}
+
+		/**
+		 * Overrides the instruction set, e.g. to compare against the scalar fallback.
+		 * Should be called before any training starts.
+		 * @returns false if the CPU doesn't support the given instruction set, and nothing is changed.
+		 */
+		inline bool select_isa(int id) {
+			if (id < isa::Scalar || id > detect_isa()) return false;
+			current_ops<double, double>() = make_ops<double, double>(id);
+			current_ops<float, float>() = make_ops<float, float>(id);
+			current_ops<float, bf16>() = make_ops<float, bf16>(id);
+			current_ops<float, fp16>() = make_ops<float, fp16>(id);
+			return true;
+		}
+
+		/* Tile sizes, chosen to keep a (GEMM_BLOCK_N x GEMM_BLOCK_K) tile of doubles within 256KB of L2(128KB for floats). */
+		static const int GEMM_BLOCK_N = 64;
+		static const int GEMM_BLOCK_K = 256;
+		/* Rows of the left-hand matrix computed together, sharing each load of the right-hand matrix. */
+		static const int GEMM_ROWS = 4;
+
+		/**
+		 * C[m][n] (+)= sum_k A[m][k] * B[n][k]
+		 * Used for forward propagation, where B is the weight matrix keeping each neuron's input weights contiguous.
+		 * The threads split both the column blocks and the rows of C, and each keeps its B tile in cache over its rows.
+		 * @param accumulate If false, C is overwritten instead of being added to.
+		 */
+		template<typename T, typename S>
+		void gemm_nt(ThreadPool* pool, int M, int N, int K, const S* A, int lda, const S* B, int ldb, T* C, int ldc, bool accumulate = false) {
+			const Ops<T, S>& k = ops<T, S>();
+			if (!accumulate) {
+				for (int m = 0; m < M; m++)
+					for (int n = 0; n < N; n++)
+						C[m * ldc + n] = 0;
+			}
+
+			/* Work items of GEMM_ROWS rows in a column block, numbered along the rows of each block */
+			const int groups = (M + GEMM_ROWS - 1) / GEMM_ROWS;
+			const int blocks = (N + GEMM_BLOCK_N - 1) / GEMM_BLOCK_N;
+			parallel_for(pool, blocks * groups, (double) M * N * K, [&](int begin, int end) {
+				for (int item = begin; item < end; ) {
+					const int block_end = std::min(end, (item / groups + 1) * groups);
+					const int nb = item / groups * GEMM_BLOCK_N;
+					const int n_end = std::min(nb + GEMM_BLOCK_N, N);
+					const int m_begin = item % groups * GEMM_ROWS;
+					const int m_end = std::min(m_begin + (block_end - item) * GEMM_ROWS, M);
+					item = block_end;
+
+					for (int kb = 0; kb < K; kb += GEMM_BLOCK_K) {
+						const int k_len = std::min(GEMM_BLOCK_K, K - kb);
+
+						int m = m_begin;
+						for (; m + GEMM_ROWS <= m_end; m += GEMM_ROWS) {
+							const S* a0 = A + (m + 0) * lda + kb;
+							const S* a1 = A + (m + 1) * lda + kb;
+							const S* a2 = A + (m + 2) * lda + kb;
+							const S* a3 = A + (m + 3) * lda + kb;
+							for (int n = nb; n < n_end; n++) {
+								T s[GEMM_ROWS];
+								k.dot4(a0, a1, a2, a3, B + n * ldb + kb, k_len, s);
+								C[(m + 0) * ldc + n] += s[0];
+								C[(m + 1) * ldc + n] += s[1];
+								C[(m + 2) * ldc + n] += s[2];
+								C[(m + 3) * ldc + n] += s[3];
+							}
+						}
+						for (; m < m_end; m++) {
+							const S* a = A + m * lda + kb;
+							for (int n = nb; n < n_end; n++) {
+								C[m * ldc + n] += k.dot(a, B + n * ldb + kb, k_len);
+							}
+						}
+					}
+				}
+			});
+		}
+
+		/**
+		 * C[m][n] (+)= sum_k A[m][k] * B[k][n]
+		 * Used for backpropagation of the delta through the weight matrix.
+		 * @param accumulate If false, C is overwritten instead of being added to.
+		 */
+		template<typename T, typename S>
+		void gemm_nn(ThreadPool* pool, int M, int N, int K, const T* A, int lda, const S* B, int ldb, T* C, int ldc, bool accumulate = false) {
+			const Ops<T, S>& k = ops<T, S>();
+			if (!accumulate) {
+				for (int m = 0; m < M; m++)
+					for (int n = 0; n < N; n++)
+						C[m * ldc + n] = 0;
+			}
+
+			/* Work items of a row in a column strip of C, so no two threads write the same element. */
+			const int strips = (N + GEMM_BLOCK_K - 1) / GEMM_BLOCK_K;
+			parallel_for(pool, strips * M, (double) M * N * K, [&](int begin, int end) {
+				for (int item = begin; item < end; ) {
+					const int strip_end = std::min(end, (item / M + 1) * M);
+					const int nb = item / M * GEMM_BLOCK_K;
+					const int n_len = std::min(GEMM_BLOCK_K, N - nb);
+					const int m_begin = item % M;
+					const int m_end = m_begin + (strip_end - item);
+					item = strip_end;
+
+					for (int kb = 0; kb < K; kb += GEMM_BLOCK_N) {
+						const int k_end = std::min(kb + GEMM_BLOCK_N, K);
+						for (int m = m_begin; m < m_end; m++) {
+							T* c = C + m * ldc + nb;
+							const T* a = A + m * lda;
+							for (int kk = kb; kk < k_end; kk++) {
+								k.axpy(n_len, a[kk], B + kk * ldb + nb, c);
+							}
+						}
+					}
+				}
+			});
+		}
+
+		/**
+		 * C[m][n] (+)= sum_k A[k][m] * B[k][n]
+		 * Used to sum up the weight gradient(delta x input) of the whole minibatch, where k runs over the samples.
+		 * @param accumulate If false, C is overwritten instead of being added to.
+		 */
+		template<typename T, typename S>
+		void gemm_tn(ThreadPool* pool, int M, int N, int K, const T* A, int lda, const S* B, int ldb, T* C, int ldc, bool accumulate = false) {
+			const Ops<T, S>& k = ops<T, S>();
+			if (!accumulate) {
+				for (int m = 0; m < M; m++)
+					for (int n = 0; n < N; n++)
+						C[m * ldc + n] = 0;
+			}
+
+			/* Work items of a row in a column strip of C. Each thread keeps its rows of the strip in cache over all k */
+			const int strips = (N + GEMM_BLOCK_K - 1) / GEMM_BLOCK_K;
+			parallel_for(pool, strips * M, (double) M * N * K, [&](int begin, int end) {
+				for (int item = begin; item < end; ) {
+					const int strip_end = std::min(end, (item / M + 1) * M);
+					const int nb = item / M * GEMM_BLOCK_K;
+					const int n_len = std::min(GEMM_BLOCK_K, N - nb);
+					const int m_begin = item % M;
+					const int m_end = m_begin + (strip_end - item);
+					item = strip_end;
+
+					/* Rows in blocks of GEMM_BLOCK_N, to keep the (GEMM_BLOCK_N x GEMM_BLOCK_K) tile of C in cache */
+					for (int mb = m_begin; mb < m_end; mb += GEMM_BLOCK_N) {
+						const int mb_end = std::min(mb + GEMM_BLOCK_N, m_end);
+						for (int kk = 0; kk < K; kk++) {
+							const T* a = A + kk * lda;
+							const S* b = B + kk * ldb + nb;
+							for (int m = mb; m < mb_end; m++) {
+								k.axpy(n_len, a[m], b, C + m * ldc + nb);
+							}
+						}
+					}
+				}
+			});
+		}
+	}
+}
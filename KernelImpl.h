@@ -0,0 +1,346 @@
+/**
+ * Kernel bodies, written once against `simd::<isa>::V<T>`.
+ * T is the type the arithmetic is done in, and S is the type the weights and activations are stored in; they differ only in the mixed precision mode.
+ * This file is intentionally included multiple times from `Kernel.h`, once per instruction set, with `NN_KERNEL_ISA` defined as the namespace name.
+ * Do not include this file directly.
+ */
+
+#ifndef NN_KERNEL_ISA
+#error "KernelImpl.h must be included from Kernel.h"
+#endif
+
+namespace nn {
+	namespace kernel {
+		namespace NN_KERNEL_ISA {
+			using simd::NN_KERNEL_ISA::V;
+
+			/** sum_i a[i] * b[i] */
+			template<typename T, typename S>
+			T dot(const S* a, const S* b, int n) {
+				typedef V<T> v;
+				typename v::reg s0 = v::zero(), s1 = v::zero();
+				int i = 0;
+				for (; i + 2 * v::width <= n; i += 2 * v::width) {
+					s0 = v::fmadd(v::loadu(a + i), v::loadu(b + i), s0);
+					s1 = v::fmadd(v::loadu(a + i + v::width), v::loadu(b + i + v::width), s1);
+				}
+				for (; i + v::width <= n; i += v::width) {
+					s0 = v::fmadd(v::loadu(a + i), v::loadu(b + i), s0);
+				}
+				T sum = v::hsum(v::add(s0, s1));
+				for (; i < n; i++) {
+					sum += (T) a[i] * (T) b[i];
+				}
+				return sum;
+			}
+
+			/** out[r] = sum_i a_r[i] * b[i] for four rows a_0..a_3 sharing the loads of b. */
+			template<typename T, typename S>
+			void dot4(const S* a0, const S* a1, const S* a2, const S* a3, const S* b, int n, T* out) {
+				typedef V<T> v;
+				typename v::reg s0 = v::zero(), s1 = v::zero(), s2 = v::zero(), s3 = v::zero();
+				int i = 0;
+				for (; i + v::width <= n; i += v::width) {
+					typename v::reg bv = v::loadu(b + i);
+					s0 = v::fmadd(v::loadu(a0 + i), bv, s0);
+					s1 = v::fmadd(v::loadu(a1 + i), bv, s1);
+					s2 = v::fmadd(v::loadu(a2 + i), bv, s2);
+					s3 = v::fmadd(v::loadu(a3 + i), bv, s3);
+				}
+				T r0 = v::hsum(s0), r1 = v::hsum(s1), r2 = v::hsum(s2), r3 = v::hsum(s3);
+				for (; i < n; i++) {
+					const T bi = (T) b[i];
+					r0 += (T) a0[i] * bi;
+					r1 += (T) a1[i] * bi;
+					r2 += (T) a2[i] * bi;
+					r3 += (T) a3[i] * bi;
+				}
+				out[0] = r0;
+				out[1] = r1;
+				out[2] = r2;
+				out[3] = r3;
+			}
+
+			/** y[i] += alpha * x[i]. Used for the outer products and the delta propagation. */
+			template<typename T, typename S>
+			void axpy(int n, T alpha, const S* x, T* y) {
+				typedef V<T> v;
+				typename v::reg av = v::set1(alpha);
+				int i = 0;
+				for (; i + 2 * v::width <= n; i += 2 * v::width) {
+					v::storeu(y + i, v::fmadd(av, v::loadu(x + i), v::loadu(y + i)));
+					v::storeu(y + i + v::width, v::fmadd(av, v::loadu(x + i + v::width), v::loadu(y + i + v::width)));
+				}
+				for (; i + v::width <= n; i += v::width) {
+					v::storeu(y + i, v::fmadd(av, v::loadu(x + i), v::loadu(y + i)));
+				}
+				for (; i < n; i++) {
+					y[i] += alpha * (T) x[i];
+				}
+			}
+
+			/** out[i] = in[i], rounded to the storage type */
+			template<typename T, typename S>
+			void narrow(int n, const T* in, S* out) {
+				typedef V<T> v;
+				int i = 0;
+				for (; i + v::width <= n; i += v::width) {
+					v::storeu(out + i, v::loadu(in + i));
+				}
+				for (; i < n; i++) {
+					out[i] = S(in[i]);
+				}
+			}
+
+			/** out[i] = in[i], expanded from the storage type */
+			template<typename T, typename S>
+			void widen(int n, const S* in, T* out) {
+				typedef V<T> v;
+				int i = 0;
+				for (; i + v::width <= n; i += v::width) {
+					v::storeu(out + i, v::loadu(in + i));
+				}
+				for (; i < n; i++) {
+					out[i] = (T) in[i];
+				}
+			}
+
+			/** out[i] = scale * in[i], from bytes to the storage type. The bytes are widened a register at a time, then scaled in T. */
+			template<typename T, typename S>
+			void dequantize(int n, const unsigned char* in, T scale, S* out) {
+				typedef V<T> v;
+				typename v::reg sv = v::set1(scale);
+				T buf[v::width];
+				int i = 0;
+				for (; i + v::width <= n; i += v::width) {
+					for (int k = 0; k < v::width; k++) buf[k] = (T) in[i + k];
+					v::storeu(out + i, v::mul(v::loadu(buf), sv));
+				}
+				for (; i < n; i++) {
+					out[i] = S(scale * (T) in[i]);
+				}
+			}
+
+			/**
+			 * out[i] = `image` sampled at (x[i], y[i]) with bilinear interpolation, for the image transforms(see `Augmenter`).
+			 * `image` is [(height + 2) x (width + 2)], the image with a border of zeros, and the points are clamped to the border.
+			 * The coordinates, the weights and the blend are computed a register at a time, and only the four neighbours are fetched one by one.
+			 */
+			template<typename T>
+			void bilinear(int n, const T* image, int width, int height, const T* x, const T* y, T* out) {
+				typedef V<T> v;
+				typedef typename v::reg reg;
+				const int row = width + 2;
+				/* Adding and subtracting the magic number rounds to the nearest integer, so floor(a) is within 1 of round(a - 0.5) */
+				const reg magic = v::set1(ExpConsts<T>::round_magic()), half = v::set1((T) 0.5), one = v::set1(1), zero = v::zero();
+				const reg x_max = v::set1((T) (width + 1)), y_max = v::set1((T) (height + 1));
+				const reg x_floor_max = v::set1((T) width), y_floor_max = v::set1((T) height);
+
+				T xs[v::width], ys[v::width], p00[v::width], p01[v::width], p10[v::width], p11[v::width];
+				for (int i = 0; i < n; i += v::width) {
+					const int m = std::min((int) v::width, n - i);
+					for (int k = 0; k < v::width; k++) {
+						xs[k] = (k < m) ? x[i + k] : 0;
+						ys[k] = (k < m) ? y[i + k] : 0;
+					}
+					/* In the coordinates of the bordered image */
+					const reg px = v::minimum(v::maximum(v::add(v::loadu(xs), one), zero), x_max);
+					const reg py = v::minimum(v::maximum(v::add(v::loadu(ys), one), zero), y_max);
+					const reg fx = v::minimum(v::maximum(v::sub(v::add(v::sub(px, half), magic), magic), zero), x_floor_max);
+					const reg fy = v::minimum(v::maximum(v::sub(v::add(v::sub(py, half), magic), magic), zero), y_floor_max);
+					v::storeu(xs, fx);
+					v::storeu(ys, fy);
+					for (int k = 0; k < v::width; k++) {
+						const T* p = image + (int) ys[k] * row + (int) xs[k];
+						p00[k] = p[0];
+						p01[k] = p[1];
+						p10[k] = p[row];
+						p11[k] = p[row + 1];
+					}
+
+					/* Weights of the right and lower neighbours, in [0, 1] */
+					const reg wx = v::sub(px, fx), wy = v::sub(py, fy);
+					const reg a = v::loadu(p00), b = v::loadu(p10);
+					const reg top = v::fmadd(wx, v::sub(v::loadu(p01), a), a);
+					const reg bottom = v::fmadd(wx, v::sub(v::loadu(p11), b), b);
+					v::storeu(xs, v::fmadd(wy, v::sub(bottom, top), top));
+					for (int k = 0; k < m; k++) out[i + k] = xs[k];
+				}
+			}
+
+			/* Element-wise functions for `map()`, built on the exp in `ExpConsts` */
+
+			template<typename v, typename T>
+			inline typename v::reg exp_reg(typename v::reg x) {
+				typedef ExpConsts<T> c;
+				typedef typename v::reg reg;
+				x = v::minimum(v::maximum(x, v::set1(c::lo())), v::set1(c::hi()));
+				const reg magic = v::set1(c::round_magic());
+				const reg n = v::sub(v::add(v::mul(x, v::set1(c::log2e())), magic), magic);
+				reg r = v::fnmadd(n, v::set1(c::ln2_hi()), x);
+				r = v::fnmadd(n, v::set1(c::ln2_lo()), r);
+
+				/* Horner's method from the 1/degree! term down to 1/0! */
+				reg p = v::set1(c::coef(c::degree));
+				for (int k = c::degree - 1; k >= 0; k--) {
+					p = v::fmadd(p, r, v::set1(c::coef(k)));
+				}
+				return v::mul(p, v::pow2n(n));
+			}
+
+			/** e^x */
+			struct Exp {
+				template<typename v, typename T>
+				static inline typename v::reg calc(typename v::reg x) {
+					return exp_reg<v, T>(x);
+				}
+			};
+
+			/** 1 / (1 + e^-x) */
+			struct Sigmoid {
+				template<typename v, typename T>
+				static inline typename v::reg calc(typename v::reg x) {
+					const typename v::reg one = v::set1(1);
+					return v::div(one, v::add(one, exp_reg<v, T>(v::sub(v::zero(), x))));
+				}
+			};
+
+			/** 1 - 2 / (e^2x + 1) */
+			struct Tanh {
+				template<typename v, typename T>
+				static inline typename v::reg calc(typename v::reg x) {
+					const typename v::reg one = v::set1(1);
+					return v::sub(one, v::div(v::set1(2), v::add(exp_reg<v, T>(v::add(x, x)), one)));
+				}
+			};
+
+			/** Runs `Fn` over n elements, full registers first and the tail with the scalar wrapper. */
+			template<typename Fn, typename T>
+			void map(int n, const T* in, T* out) {
+				typedef V<T> v;
+				int i = 0;
+				for (; i + v::width <= n; i += v::width) {
+					v::storeu(out + i, Fn::template calc<v, T>(v::loadu(in + i)));
+				}
+				for (; i < n; i++) {
+					out[i] = Fn::template calc<simd::scalar::V<T>, T>(in[i]);
+				}
+			}
+
+			/*
+			 * Optimizer updates, one fused pass over the weights, their optimizer state(s0, s1) and the gradient.
+			 * Each step computes the loss as `p.scale * g[i]`, and applies `w -= p.decay * w` together with its own difference(multiplied by `p.inv_scale`).
+			 */
+
+			template<typename v, typename T>
+			inline typename v::reg decayed(typename v::reg w, typename v::reg diff, const UpdateParams<T>& p) {
+				return v::add(w, v::fnmadd(v::set1(p.decay), w, v::mul(diff, v::set1(p.inv_scale))));
+			}
+
+			/** w += lr * loss */
+			struct Sgd {
+				template<typename v, typename T>
+				static inline void step(int i, T* w, T*, T*, const T* g, const UpdateParams<T>& p) {
+					typename v::reg loss = v::mul(v::set1(p.scale), v::loadu(g + i));
+					typename v::reg diff = v::mul(v::set1(p.lr), loss);
+					v::storeu(w + i, decayed<v>(v::loadu(w + i), diff, p));
+				}
+			};
+
+			/** v = mu * v + lr * loss; w += v */
+			struct Momentum {
+				template<typename v, typename T>
+				static inline void step(int i, T* w, T* s0, T*, const T* g, const UpdateParams<T>& p) {
+					typename v::reg loss = v::mul(v::set1(p.scale), v::loadu(g + i));
+					typename v::reg vel = v::fmadd(v::set1(p.beta1), v::loadu(s0 + i), v::mul(v::set1(p.lr), loss));
+					v::storeu(s0 + i, vel);
+					v::storeu(w + i, decayed<v>(v::loadu(w + i), vel, p));
+				}
+			};
+
+			/** v' = mu * v - lr * loss; w += mu * v - (1 + mu) * v' */
+			struct Nesterov {
+				template<typename v, typename T>
+				static inline void step(int i, T* w, T* s0, T*, const T* g, const UpdateParams<T>& p) {
+					typename v::reg loss = v::mul(v::set1(p.scale), v::loadu(g + i));
+					typename v::reg prev = v::mul(v::set1(p.beta1), v::loadu(s0 + i));
+					typename v::reg vel = v::fnmadd(v::set1(p.lr), loss, prev);
+					v::storeu(s0 + i, vel);
+					typename v::reg diff = v::fnmadd(v::set1(1 + p.beta1), vel, prev);
+					v::storeu(w + i, decayed<v>(v::loadu(w + i), diff, p));
+				}
+			};
+
+			/** G += loss^2; w += lr * loss / (sqrt(G) + eps) */
+			struct Adagrad {
+				template<typename v, typename T>
+				static inline void step(int i, T* w, T* s0, T*, const T* g, const UpdateParams<T>& p) {
+					typename v::reg loss = v::mul(v::set1(p.scale), v::loadu(g + i));
+					typename v::reg acc = v::fmadd(loss, loss, v::loadu(s0 + i));
+					v::storeu(s0 + i, acc);
+					typename v::reg diff = v::div(v::mul(v::set1(p.lr), loss), v::add(v::sqrt(acc), v::set1(p.epsilon)));
+					v::storeu(w + i, decayed<v>(v::loadu(w + i), diff, p));
+				}
+			};
+
+			/** G = rho * G + (1 - rho) * loss^2; w += lr * loss / (sqrt(G) + eps), with rho given as beta2 */
+			struct RMSProp {
+				template<typename v, typename T>
+				static inline void step(int i, T* w, T* s0, T*, const T* g, const UpdateParams<T>& p) {
+					typename v::reg loss = v::mul(v::set1(p.scale), v::loadu(g + i));
+					typename v::reg acc = v::fmadd(v::set1(p.beta2), v::loadu(s0 + i), v::mul(v::set1(1 - p.beta2), v::mul(loss, loss)));
+					v::storeu(s0 + i, acc);
+					typename v::reg diff = v::div(v::mul(v::set1(p.lr), loss), v::add(v::sqrt(acc), v::set1(p.epsilon)));
+					v::storeu(w + i, decayed<v>(v::loadu(w + i), diff, p));
+				}
+			};
+
+			/** m = b1 * m + (1 - b1) * loss; v = b2 * v + (1 - b2) * loss^2; w += lr_t * m / (sqrt(v) + eps) */
+			struct Adam {
+				template<typename v, typename T>
+				static inline void step(int i, T* w, T* s0, T* s1, const T* g, const UpdateParams<T>& p) {
+					typename v::reg loss = v::mul(v::set1(p.scale), v::loadu(g + i));
+					typename v::reg m = v::fmadd(v::set1(p.beta1), v::loadu(s0 + i), v::mul(v::set1(1 - p.beta1), loss));
+					typename v::reg sq = v::fmadd(v::set1(p.beta2), v::loadu(s1 + i), v::mul(v::set1(1 - p.beta2), v::mul(loss, loss)));
+					v::storeu(s0 + i, m);
+					v::storeu(s1 + i, sq);
+					typename v::reg diff = v::div(v::mul(v::set1(p.lr), m), v::add(v::sqrt(sq), v::set1(p.epsilon)));
+					v::storeu(w + i, decayed<v>(v::loadu(w + i), diff, p));
+				}
+			};
+
+			/** Runs `Step` over n elements, full registers first and the tail with the scalar wrapper. */
+			template<typename Step, typename T>
+			void update(int n, T* w, T* s0, T* s1, const T* g, const UpdateParams<T>& p) {
+				typedef V<T> v;
+				int i = 0;
+				for (; i + v::width <= n; i += v::width) {
+					Step::template step<v>(i, w, s0, s1, g, p);
+				}
+				for (; i < n; i++) {
+					Step::template step<simd::scalar::V<T> >(i, w, s0, s1, g, p);
+				}
+			}
+
+			template<typename T, typename S>
+			void fill(Ops<T, S>& ops) {
+				ops.dot = &dot<T, S>;
+				ops.dot4 = &dot4<T, S>;
+				ops.axpy = &axpy<T, S>;
+				ops.narrow = &narrow<T, S>;
+				ops.widen = &widen<T, S>;
+				ops.dequantize = &dequantize<T, S>;
+				ops.bilinear = &bilinear<T>;
+				ops.exp = &map<Exp, T>;
+				ops.sigmoid = &map<Sigmoid, T>;
+				ops.tanh = &map<Tanh, T>;
+				ops.sgd_update = &update<Sgd, T>;
+				ops.momentum_update = &update<Momentum, T>;
+				ops.nesterov_update = &update<Nesterov, T>;
+				ops.adagrad_update = &update<Adagrad, T>;
+				ops.rmsprop_update = &update<RMSProp, T>;
+				ops.adam_update = &update<Adam, T>;
+			}
+		}
+	}
+}
@@ -1,10 +1,17 @@
 #pragma once
 
 #include "Config.h"
+#include "Kernel.h"
+#include "Layout.h"
+#include "Optimizer.h"
+#include "ThreadPool.h"
+#include "ProcessGroup.h"
+#include "Random.h"
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
 #include <vector>
+#include <type_traits>
 
 #ifdef XAVIER_INITIALIZATION
 #include <limits>
@@ -12,138 +19,346 @@
 
 namespace nn {
 
-	/** Abstract interface for a layer of a neural network */
+	/**
+	 * Abstract interface for a layer of a neural network, computing in scalar type T.
+	 * The outputs passed between the layers are stored in S, which is narrower than T in the mixed precision mode(see `Network`).
+	 * The deltas are always in T.
+	 * Every input and output row is padded to `input_stride`/`output_stride` elements(see `Layout.h`), and the padding is zero.
+	 */
+	template<typename T, typename S = T>
 	class Layer {
 	public:
-		Layer(unsigned int inputs, unsigned int outputs) : inputs(inputs), outputs(outputs) {}
+		Layer(unsigned int inputs, unsigned int outputs)
+			: inputs(inputs), outputs(outputs), input_stride(layout::stride<S>(inputs)), output_stride(layout::stride<S>(outputs)) {}
 		virtual ~Layer() {}
 
 		const int inputs, outputs;
+		const int input_stride, output_stride;
 
-		virtual NUM_TYPE* forward(NUM_TYPE* prev_f, bool train = false) = 0;
-		virtual NUM_TYPE* backward(NUM_TYPE* prev_delta) = 0;
+		virtual S* forward(S* prev_f, bool train = false) = 0;
+		virtual T* backward(T* prev_delta) = 0;
+		virtual S* forward_batch(int n, S* prev_f, bool train = false, int replica = 0) = 0;
+		virtual T* backward_batch(int n, T* prev_delta, int replica = 0) = 0;
+		/**
+		 * Forward propagates `n` rows into buffers of the caller, without touching the ones of the layer, for `Network::infer()`.
+		 * Runs on the calling thread alone, so any number of threads may call it at the same time.
+		 * @param prev_f Row-major [n x input_stride] matrix of the inputs.
+		 * @param f Row-major [n x output_stride] matrix of the outputs. The padding must be zero.
+		 * @param z [n x output_stride] pre-activation in T, the same array as `f` unless S differs from T.
+		 */
+		virtual void infer(int n, const S* prev_f, S* f, T* z) const = 0;
 		virtual void initialize_weights() = 0;
-		virtual void update_weights(NUM_TYPE* prev_f) = 0;
 
+		/**
+		 * Replaces the optimizer of the weights, see `optimizer::types`. The new optimizer starts with zeroed states.
+		 * @throws std::invalid_argument if `type` is unknown.
+		 */
+		virtual void set_optimizer(int type) = 0;
+		/** Sets the threads the layer splits its work over, or NULL to run on the calling thread. The pool is not owned. */
+		virtual void set_thread_pool(ThreadPool* pool) = 0;
 #ifdef BATCH_TRAIN
-		virtual void clear_delta() = 0;
+		/**
+		 * Sets the number of replicas of the minibatch buffers and the gradient sums, for the data-parallel training.
+		 * Each replica can propagate its own part of the batch at the same time, see `forward_batch()`.
+		 */
+		virtual void set_replicas(int count) = 0;
+		/** Sums up the gradients of the first `count` replicas into the first one, to be applied by `update_weights()`. */
+		virtual void reduce_gradients(int count) = 0;
+#ifdef __linux__
+		/** Sums up the gradients of replica 0 over all the processes of the group, leaving the same sums in every process. */
+		virtual void all_reduce_gradients(ProcessGroup& group) = 0;
+#endif
+		virtual void clear_delta(int replica = 0) = 0;
+		virtual void update_weights(const kernel::UpdateParams<T>& params, int replica = 0) = 0;
+#else
+		virtual void update_weights(S* prev_f, const kernel::UpdateParams<T>& params) = 0;
 #endif
 
 		virtual char getActivationType() = 0;
-		virtual std::vector<NUM_TYPE> dump_weights() { return std::vector<NUM_TYPE>(); }
-		virtual int load_weights(NUM_TYPE* begin, int limit = -1) { return 0; }
+		virtual std::vector<T> dump_weights() { return std::vector<T>(); }
+		virtual int load_weights(T* begin, int limit = -1) { return 0; }
+		/** Overwrites the weights with the ones of `from`, a layer of the same type and size. */
+		virtual void copy_weights(const Layer<T, S>&) {}
 	};
 
-	/** Real implementation of the layer, abstracted to add capability to use activation functions per layer. */
-	template<typename Activation>
-	class LayerImpl : public Layer {
+	/**
+	 * Real implementation of the layer, abstracted to add capability to use activation functions per layer.
+	 * The weights are kept as [outputs x input_stride] rows followed by the bias vector, in a single aligned array.
+	 * The optimizer states share the same layout, so the biases are updated by the same kernel as a row of weights.
+	 * The optimizer is chosen at runtime, and updates the layer with the parameters of the step given by the `Network`(see `Optimizer.h`).
+	 * With `LAZY_WEIGHT_DECAY`, the weights and biases are stored divided by `weight_scale`. The weight decay only shrinks the scale, and the propagation multiplies its sums by it.
+	 * When S differs from T, the optimizer updates the master weights in T, and each updated row is rounded into a copy in S.
+	 * The propagation only reads the copy in S, so it moves half the bytes of the weights and the outputs.
+	 */
+	template<typename Activation, typename T = NUM_TYPE, typename S = T>
+	class LayerImpl : public Layer<T, S> {
 	public:
-		LayerImpl(unsigned int inputs, unsigned int outputs)
-		: Layer(inputs, outputs),
-			weights(new NUM_TYPE[(inputs + 1) * outputs]),
-
-#if defined(OPTIMIZE_ADAM)
-			last_m(new NUM_TYPE[(inputs + 1) * outputs]()),
-			last_v(new NUM_TYPE[(inputs + 1) * outputs]()),
-			lr_t(0),
-			beta1_sq(1), beta2_sq(1),
-#elif defined(OPTIMIZE_ADAGRAD) || defined(OPTIMIZE_RMSPROP)
-			last_g(new NUM_TYPE[(inputs + 1) * outputs]()),
-#elif defined(OPTIMIZE_MOMENTUM) || defined(OPTIMIZE_NESTEROV)
-			last_v(new NUM_TYPE[(inputs + 1) * outputs]()),
-#endif
+		using Layer<T, S>::inputs;
+		using Layer<T, S>::outputs;
+		using Layer<T, S>::input_stride;
+		using Layer<T, S>::output_stride;
 
-			last_f(new NUM_TYPE[outputs]),
-			last_delta(new NUM_TYPE[outputs]),
-			last_prop_delta(new NUM_TYPE[inputs]),
-#ifdef BATCH_TRAIN
-			delta_sum(new NUM_TYPE[outputs]),
-			batch_count(0),
+		LayerImpl(unsigned int inputs, unsigned int outputs)
+		: Layer<T, S>(inputs, outputs),
+			bias_offset(outputs * input_stride),
+			param_count(bias_offset + output_stride),
+			weights(layout::allocate<T>(param_count)),
+			weights_lp(mixed ? layout::allocate<S>(param_count) : reinterpret_cast<S*>(weights)),
+			biases(weights + bias_offset),
+			weight_optimizer(DEFAULT_OPTIMIZER, param_count),
+			pool(NULL),
+			weight_scale(1),
+			last_f(layout::allocate<S>(output_stride)),
+			last_z(mixed ? layout::allocate<T>(output_stride) : reinterpret_cast<T*>(last_f)),
+			last_df(layout::allocate<T>(output_stride)),
+			last_delta(layout::allocate<T>(output_stride)),
+			last_prop_delta(layout::allocate<T>(input_stride)),
+#ifndef BATCH_TRAIN
+			input_buf(mixed ? layout::allocate<T>(input_stride) : NULL),
 #endif
 			activation()
 		{
-
+			replicas.push_back(create_replica());
 		}
 
 		~LayerImpl() {
-#ifdef BATCH_TRAIN
-			delete[] delta_sum;
-#endif
-			delete[] last_prop_delta;
-			delete[] last_delta;
-			delete[] last_f;
-
-#if defined(OPTIMIZE_RMSPROP)
-			delete[] last_g;
-#elif defined(OPTIMIZE_MOMENTUM)
-			delete[] last_v;
+			for (size_t r = 0; r < replicas.size(); r++) {
+				release_replica(replicas[r]);
+			}
+#ifndef BATCH_TRAIN
+			layout::release(input_buf);
 #endif
-			delete[] weights;
+			layout::release(last_prop_delta);
+			layout::release(last_delta);
+			layout::release(last_df);
+			if (mixed) layout::release(last_z);
+			layout::release(last_f);
+
+			if (mixed) layout::release(weights_lp);
+			layout::release(weights);
 		}
 
 		/**
 		 * Forward propagate with given input.
-		 * @returns Calculated output of length same as the output of this layer. Should not be deleted or modified.
+		 * With `train`, the activation derivative f'(z) is calculated along with the output and kept for `backward()`.
+		 * @param prev_f Input of `input_stride` elements.
+		 * @returns Calculated output of `output_stride` elements. Should not be deleted or modified.
 		 */
-		NUM_TYPE* forward(NUM_TYPE* prev_f, bool train = false) override {
-			#pragma omp parallel for
-			for (int j = 0; j < outputs; j++) {
-#ifdef DROPOUT_RATE
-				if (train && rand() * (1.0 / RAND_MAX) <= DROPOUT_RATE) {
-					last_f[j] = 0;
-					continue;
-				}
+		S* forward(S* prev_f, bool train = false) override {
+#ifdef BATCH_TRAIN
+			if (train) replicas[0].last_input = prev_f;
 #endif
-				NUM_TYPE sum = 0;
-				for (int i = 0; i < inputs; i++) {
-					sum += prev_f[i] * weight(i, j);
+			parallel_for(pool, outputs, (double) outputs * input_stride, [&](int begin, int end) {
+				for (int j = begin; j < end; j++) {
+					/* Bias(weight from constant-one) is just added with no multiplication */
+					last_z[j] = (T) weight_scale * (kernel::ops<T, S>().dot(prev_f, weights_lp + j * input_stride, input_stride) + biases[j]);
+				}
+			});
+			activate(last_z, last_f, train ? last_df : NULL, outputs);
+#ifdef DROPOUT_RATE
+			if (train) {
+				for (int j = 0; j < outputs; j++) {
+					/* A dropped output passes no gradient back either */
+					if (Random::local().uniform() <= DROPOUT_RATE) last_f[j] = S(0), last_df[j] = 0;
 				}
-				/* Bias(weight from constant-one) is just added with no multiplication */
-				last_f[j] = activation.calculate(sum + weight(inputs, j));
 			}
+#endif
 
 			return last_f;
 		}
 
 #ifdef BATCH_TRAIN
-		void clear_delta() override {
-			for(int i = 0; i < outputs; i++) {
-				delta_sum[i] = 0;
+		void clear_delta(int replica = 0) override {
+			Replica& rep = replicas[replica];
+			memset(rep.delta_sum, 0, sizeof(T) * outputs);
+			memset(rep.weight_grad, 0, sizeof(T) * bias_offset);
+			rep.batch_count = 0;
+		}
+
+		void set_replicas(int count) override {
+			assert(count >= 1);
+			while ((int) replicas.size() > count) {
+				release_replica(replicas.back());
+				replicas.pop_back();
+			}
+			while ((int) replicas.size() < count) {
+				replicas.push_back(create_replica());
+			}
+		}
+
+		/**
+		 * Sums up the gradients of the replicas with a binary tree: replica r takes in replica r + 1, then r + 2, r + 4, ... for the r's aligned to twice the distance.
+		 * Every element is added in the same order whatever the number of threads, so the result only depends on the number of replicas.
+		 */
+		void reduce_gradients(int count) override {
+			assert(count <= (int) replicas.size());
+			for (int step = 1; step < count; step *= 2) {
+				const int pairs = (count + step - 1) / (2 * step);
+				parallel_for(pool, outputs, (double) pairs * outputs * input_stride, [&](int begin, int end) {
+					for (int r = 0; r + step < count; r += 2 * step) {
+						Replica& dst = replicas[r];
+						const Replica& src = replicas[r + step];
+						kernel::ops<T>().axpy((end - begin) * input_stride, 1, src.weight_grad + begin * input_stride, dst.weight_grad + begin * input_stride);
+						kernel::ops<T>().axpy(end - begin, 1, src.delta_sum + begin, dst.delta_sum + begin);
+					}
+				});
+				for (int r = 0; r + step < count; r += 2 * step) {
+					replicas[r].batch_count += replicas[r + step].batch_count;
+				}
 			}
-			batch_count = 0;
+		}
+
+#ifdef __linux__
+		void all_reduce_gradients(ProcessGroup& group) override {
+			Replica& rep = replicas[0];
+			group.all_reduce(rep.weight_grad, bias_offset);
+			group.all_reduce(rep.delta_sum, outputs);
+			group.all_reduce(&rep.batch_count, 1);
 		}
+#endif
 #endif
 
 		/**
-		* Backpropagate with error from the top layer.
+		* Backpropagate with error from the top layer, through the activation derivative kept by the last `forward()` with `train`.
 		* This method calculates and keeps the loss. This will be used on weight update, and is overwritten on future `backward()` call.
-		* TODO: To enable batch weight update, the loss have to be sumed up
-		* @returns Error to propagate to lower layer, length of this layer's input. This array should not be deleted.
+		* With `BATCH_TRAIN`, the weight gradient(delta x input of the last `forward()`) is summed up until `clear_delta()`.
+		* @returns Error to propagate to lower layer, `input_stride` elements. This array should not be deleted.
 		*/
-		NUM_TYPE* backward(NUM_TYPE* prev_delta) override {
-			/* Calculate the loss derivative from the backpropagated delta */
-			#pragma omp parallel for
-			for(int i = 0; i < outputs; i++) {
-				last_delta[i] = activation.derivative(last_f[i]) * prev_delta[i];
+		T* backward(T* prev_delta) override {
+			/* Calculate the loss derivative from the backpropagated delta, multiplied by the weight scale to propagate through the stored weights */
+			const T scale = (T) weight_scale;
 #ifdef BATCH_TRAIN
-				delta_sum[i] += last_delta[i];
+			const double cost = (double) outputs * input_stride;
+#else
+			const double cost = outputs;
 #endif
-			}
+			Replica& rep = replicas[0];
+			parallel_for(pool, outputs, cost, [&](int begin, int end) {
+				for(int i = begin; i < end; i++) {
+					last_delta[i] = scale * last_df[i] * prev_delta[i];
 #ifdef BATCH_TRAIN
-			batch_count++;
+					rep.delta_sum[i] += last_delta[i];
+
+					kernel::ops<T, S>().axpy(input_stride, last_delta[i], rep.last_input, rep.weight_grad + i * input_stride);
+#endif
+				}
+			});
+#ifdef BATCH_TRAIN
+			rep.batch_count++;
 #endif
 
 			/* Calculate delta to propagate, to keep from this layer's weight to be used outside of this instance. */
-			#pragma omp parallel for
-			for(int i = 0; i < inputs; i++) {
-				NUM_TYPE sum = 0;
-				for(int j = 0; j < outputs; j++) {
-					sum += last_delta[j] * weight(i, j);
+			kernel::gemm_nn(pool, 1, input_stride, outputs, last_delta, outputs, weights_lp, input_stride, last_prop_delta, input_stride);
+
+			return last_prop_delta;
+		}
+
+		/**
+		 * Forward propagate a whole minibatch at once.
+		 * The weights are read once per cache tile for every sample in the batch, instead of once per sample.
+		 * The bias is the initial value of the GEMM output, and the activation(and its derivative with `train`) runs on each row right after it.
+		 * With several replicas(see `set_replicas()`), different threads may propagate different parts of a batch, each on its own replica.
+		 * @param n Number of samples in the batch.
+		 * @param prev_f Row-major [n x input_stride] matrix of the inputs.
+		 * @param replica Replica of the buffers to propagate on.
+		 * @returns Row-major [n x output_stride] matrix of the outputs. Should not be deleted or modified, and is overwritten on the next batch call on the replica.
+		 */
+		S* forward_batch(int n, S* prev_f, bool train = false, int replica = 0) override {
+			Replica& rep = replicas[replica];
+			reserve_batch(rep, n);
+#ifdef BATCH_TRAIN
+			if (train) rep.last_input = prev_f;
+#endif
+			S* batch_f = rep.batch_f;
+			T* batch_z = rep.batch_z;
+			T* batch_df = rep.batch_df;
+
+			for (int b = 0; b < n; b++) {
+				memcpy(batch_z + b * output_stride, biases, sizeof(T) * output_stride);
+			}
+			kernel::gemm_nt(pool, n, outputs, input_stride, prev_f, input_stride, weights_lp, input_stride, batch_z, output_stride, true);
+
+			const T scale = (T) weight_scale;
+			parallel_for(pool, n, (double) n * outputs * ACTIVATION_COST, [&](int begin, int end) {
+				for (int b = begin; b < end; b++) {
+					T* z = batch_z + b * output_stride;
+					S* f = batch_f + b * output_stride;
+					T* df = train ? batch_df + b * outputs : NULL;
+					if (scale != 1) {
+						for (int j = 0; j < outputs; j++) z[j] *= scale;
+					}
+					activate(z, f, df, outputs);
+#ifdef DROPOUT_RATE
+					if (train) {
+						for (int j = 0; j < outputs; j++) {
+							if (Random::local().uniform() <= DROPOUT_RATE) f[j] = S(0), df[j] = 0;
+						}
+					}
+#endif
 				}
-				last_prop_delta[i] = sum;
+			});
+
+			return batch_f;
+		}
+
+		void infer(int n, const S* prev_f, S* f, T* z) const override {
+			for (int b = 0; b < n; b++) {
+				memcpy(z + b * output_stride, biases, sizeof(T) * output_stride);
 			}
+			kernel::gemm_nt(NULL, n, outputs, input_stride, prev_f, input_stride, weights_lp, input_stride, z, output_stride, true);
+
+			/* The activations keep no state, so a local one stands in for the member, whose functions aren't const */
+			Activation f_z;
+			const T scale = (T) weight_scale;
+			for (int b = 0; b < n; b++) {
+				T* row = z + b * output_stride;
+				if (scale != 1) {
+					for (int j = 0; j < outputs; j++) row[j] *= scale;
+				}
+				f_z.apply(row, row, outputs);
+				if (mixed) kernel::ops<T, S>().narrow(outputs, row, f + b * output_stride);
+			}
+		}
 
-			return last_prop_delta;
+		/**
+		 * Backpropagate a whole minibatch, with the activation derivatives kept from the last `forward_batch()` call with `train`.
+		 * With `BATCH_TRAIN`, the weight gradient of all samples is summed up with a single GEMM.
+		 * @param n Number of samples in the batch, same as the one given to `forward_batch()`.
+		 * @param prev_delta Row-major [n x output_stride] matrix of the delta from the top layer.
+		 * @param replica Replica given to `forward_batch()`. The gradient is summed up in the replica, until `reduce_gradients()`.
+		 * @returns Row-major [n x input_stride] matrix of the delta to propagate to lower layer. This array should not be deleted.
+		 */
+		T* backward_batch(int n, T* prev_delta, int replica = 0) override {
+			Replica& rep = replicas[replica];
+			assert(n <= rep.batch_capacity);
+			T* batch_df = rep.batch_df;
+			T* batch_delta = rep.batch_delta;
+
+			/* Multiplied by the weight scale as in `backward()` */
+			const T scale = (T) weight_scale;
+			parallel_for(pool, n, (double) n * outputs, [&](int begin, int end) {
+				for (int b = begin; b < end; b++) {
+					T* d = batch_delta + b * outputs;
+					const T* df = batch_df + b * outputs;
+					const T* pd = prev_delta + b * output_stride;
+					for (int j = 0; j < outputs; j++) {
+						d[j] = scale * df[j] * pd[j];
+					}
+				}
+			});
+#ifdef BATCH_TRAIN
+			for (int b = 0; b < n; b++) {
+				kernel::ops<T>().axpy(outputs, 1, batch_delta + b * outputs, rep.delta_sum);
+			}
+			rep.batch_count += n;
+
+			/* weight_grad[outputs x input_stride] += delta^T[outputs x n] * input[n x input_stride] */
+			kernel::gemm_tn(pool, outputs, input_stride, n, batch_delta, outputs, rep.last_input, input_stride, rep.weight_grad, input_stride, true);
+#endif
+
+			kernel::gemm_nn(pool, n, input_stride, outputs, batch_delta, outputs, weights_lp, input_stride, rep.batch_prop_delta, input_stride);
+
+			return rep.batch_prop_delta;
 		}
 
 		void initialize_weights() override {
@@ -155,64 +370,102 @@ namespace nn {
 #endif
 #ifdef XAVIER_INITIALIZATION
 						//generateGaussianNoise(0, sqrt(3.0 / (inputs + outputs))) // use uniform version instead of normal(gaussian) dist.
-						rand() * (1.0 / RAND_MAX) * (2 * 4.0 * sqrt(6.0 / (inputs + outputs))) - (4.0 * sqrt(6.0 / (inputs + outputs)))
+						Random::local().uniform() * (2 * 4.0 * sqrt(6.0 / (inputs + outputs))) - (4.0 * sqrt(6.0 / (inputs + outputs)))
 #else
-						((double)rand() / RAND_MAX) - 0.5
+						Random::local().uniform() - 0.5
 #endif
 						;
 				}
 			}
+			round_weights();
 		}
-		void update_weights(NUM_TYPE* prev_f) override {
-#ifdef LEARNING_RATE_DECAY
-			learning_rate = INITIAL_LEARNING_RATE * decay_factor;
-			decay_factor *= LEARNING_RATE_DECAY;
+		void set_optimizer(int type) override {
+			weight_optimizer.reset(type);
+		}
+
+		void set_thread_pool(ThreadPool* pool) override {
+			this->pool = pool;
+		}
+
+#ifdef BATCH_TRAIN
+		/**
+		 * Updates the weights with the mean gradient summed up since the last `clear_delta()`.
+		 * Threads updating from their own replicas at the same time race on the weights and the optimizer states, which the asynchronous training of `Network::train_async()` accepts.
+		 * @param step Parameters of the step from `optimizer::Schedule`.
+		 * @param replica Replica holding the gradient sums.
+		 */
+		void update_weights(const kernel::UpdateParams<T>& step, int replica = 0) override {
+#else
+		void update_weights(S* prev_f, const kernel::UpdateParams<T>& step) override {
 #endif
-#if defined(OPTIMIZE_ADAM)
-			beta1_sq *= ADAM_BETA1;
-			beta2_sq *= ADAM_BETA2;
-			lr_t = learning_rate * sqrt(1.0 - beta2_sq) / (1.0 - beta1_sq);
+			kernel::UpdateParams<T> params = step;
+			/* The deltas were multiplied by the scale of the weights they were propagated through */
+			const double grad_scale = 1 / weight_scale;
+#ifdef LAZY_WEIGHT_DECAY
+			/* (1 - decay) * scale * w + diff = scale' * (w + diff / scale') */
+			weight_scale *= 1 - params.decay;
+			params.inv_scale = (T) (1 / weight_scale);
+			params.decay = 0;
 #endif
-			#pragma omp parallel for
-			for (int j = 0; j < outputs; j++) {
 #ifdef BATCH_TRAIN
-				NUM_TYPE delta = delta_sum[j] / batch_count;
+			const int batch_count = replicas[replica].batch_count;
+			const T* weight_grad = replicas[replica].weight_grad;
+			const T* delta_sum = replicas[replica].delta_sum;
+			params.scale = (batch_count > 0) ? (T) (grad_scale / batch_count) : 0;
 #else
-				NUM_TYPE delta = last_delta[j];
+			params.scale = (T) grad_scale;
+			/* The optimizer reads the input as the gradient, so it's widened once for all the rows */
+			const T* input = reinterpret_cast<const T*>(prev_f);
+			if (mixed) {
+				kernel::ops<T, S>().widen(input_stride, prev_f, input_buf);
+				input = input_buf;
+			}
 #endif
-				for (int i = 0; i < inputs; i++) {
-					NUM_TYPE loss = delta * prev_f[i];
-					weight(i, j) +=
-						weight_diff(i, j, loss)
-#ifdef WEIGHT_DECAY
-						- WEIGHT_DECAY * weight(i, j)
+			parallel_for(pool, outputs, (double) outputs * input_stride * UPDATE_COST, [&](int begin, int end) {
+				for (int j = begin; j < end; j++) {
+					const int offset = j * input_stride;
+#ifdef BATCH_TRAIN
+					update_row(offset, input_stride, weight_grad + offset, params);
+#else
+					kernel::UpdateParams<T> p = params;
+					p.scale = params.scale * last_delta[j];
+					update_row(offset, input_stride, input, p);
 #endif
-						;
+					if (mixed) kernel::ops<T, S>().narrow(input_stride, weights + offset, weights_lp + offset);
 				}
-				weight(inputs, j) +=
-					weight_diff(inputs, j, delta)
-#ifdef WEIGHT_DECAY
-					- WEIGHT_DECAY * weight(inputs, j)
+			});
+
+			/* The bias gradient is the delta itself */
+#ifdef BATCH_TRAIN
+			update_row(bias_offset, outputs, delta_sum, params);
+#else
+			update_row(bias_offset, outputs, last_delta, params);
+#endif
+
+#ifdef LAZY_WEIGHT_DECAY
+			if (weight_scale < LAZY_WEIGHT_DECAY) renormalize();
 #endif
-					;
-			}
 		}
 
 		char getActivationType() override {
 			return (char) activation.getId();
 		}
 
-		std::vector<NUM_TYPE> dump_weights() override {
-			std::vector<NUM_TYPE> buf;
+		/**
+		 * Copies the weights in the checkpoint order, all the outputs of input 0 first and the biases last.
+		 */
+		std::vector<T> dump_weights() override {
+			std::vector<T> buf;
 			buf.reserve((inputs + 1) * outputs);
 			for (int i = 0; i <= inputs; i++) {
 				for (int j = 0; j < outputs; j++) {
-					buf.push_back(weight(i, j));
+					buf.push_back((T) weight_scale * weight(i, j));
 				}
 			}
 			return buf;
 		}
-		int load_weights(NUM_TYPE* begin, int limit = -1) override {
+		int load_weights(T* begin, int limit = -1) override {
+			weight_scale = 1;
 			int idx = 0;
 			for (int i = 0; i <= inputs; i++) {
 				for (int j = 0; j < outputs; j++) {
@@ -220,115 +473,168 @@ namespace nn {
 					weight(i, j) = begin[idx++];
 				}
 			}
+			round_weights();
 			return idx;
 		fail_too_short:
 			return -1;
 		}
+		void copy_weights(const Layer<T, S>& from) override {
+			assert(from.inputs == inputs && from.outputs == outputs);
+			const LayerImpl& layer = static_cast<const LayerImpl&>(from);
+			memcpy(weights, layer.weights, sizeof(T) * param_count);
+			if (mixed) memcpy(weights_lp, layer.weights_lp, sizeof(S) * param_count);
+			weight_scale = layer.weight_scale;
+		}
 
 	private:
-		NUM_TYPE& weight(unsigned int from, unsigned int to) const {
-			assert(from <= inputs && to < outputs);
-			/* Column-order to increase cache hit. Forward propagation and weight update are affected by this optimization. */
-			return weights[to * inputs + from];
+		/**
+		 * Minibatch buffers and gradient sums, one set per data-parallel replica.
+		 * Replica 0 also sums up the gradient of the single sample `backward()`.
+		 */
+		struct Replica {
+			/* Row-major [batch_capacity x output_stride] outputs, and their pre-activation in T(the same array unless mixed) */
+			S* batch_f;
+			T* batch_z;
+			/* [batch_capacity x outputs], unpadded as they're only read element-wise: f'(z) of the last training `forward_batch()`, and the delta */
+			T* batch_df;
+			T* batch_delta;
+			/* [batch_capacity x input_stride] delta to propagate */
+			T* batch_prop_delta;
+			int batch_capacity;
+#ifdef BATCH_TRAIN
+			/* Gradient sums over the batch; delta_sum is the one of the bias, and weight_grad is [outputs x input_stride] */
+			T* delta_sum;
+			T* weight_grad;
+			/* Input of the last training forward pass, kept to calculate the weight gradient on backward */
+			S* last_input;
+			int batch_count;
+#endif
+		};
+		std::vector<Replica> replicas;
+
+		Replica create_replica() const {
+			Replica rep;
+			rep.batch_f = NULL;
+			rep.batch_z = NULL;
+			rep.batch_df = NULL;
+			rep.batch_delta = NULL;
+			rep.batch_prop_delta = NULL;
+			rep.batch_capacity = 0;
+#ifdef BATCH_TRAIN
+			rep.delta_sum = layout::allocate<T>(output_stride);
+			rep.weight_grad = layout::allocate<T>(bias_offset);
+			rep.last_input = NULL;
+			rep.batch_count = 0;
+#endif
+			return rep;
 		}
-		NUM_TYPE* weights;
 
-		/* Optimizer implementation */
-#if defined(OPTIMIZE_ADAM)
-		NUM_TYPE& m(unsigned int from, unsigned int to) const {
-			assert(from <= inputs && to < outputs);
-			return last_m[to * inputs + from];
+		void release_replica(Replica& rep) {
+			release_batch(rep);
+#ifdef BATCH_TRAIN
+			layout::release(rep.weight_grad);
+			layout::release(rep.delta_sum);
+#endif
 		}
-		NUM_TYPE* last_m;
 
-		NUM_TYPE& v(unsigned int from, unsigned int to) const {
-			assert(from <= inputs && to < outputs);
-			return last_v[to * inputs + from];
-		}
-		NUM_TYPE* last_v;
-
-		NUM_TYPE lr_t;
-		NUM_TYPE learning_rate = INITIAL_LEARNING_RATE;
-		NUM_TYPE beta1_sq, beta2_sq;
-		//const NUM_TYPE beta1 = ADAM_BETA1, beta2 = ADAM_BETA2;
-		//const NUM_TYPE epsilon = ADAM_EPSILON;
-
-		NUM_TYPE weight_diff(int i, int j, NUM_TYPE loss) {
-			// small performance boost by storing the values temporary
-			NUM_TYPE m_ = m(i, j) = ADAM_BETA1 * m(i, j) + (1.0 - ADAM_BETA1) * loss;
-			NUM_TYPE v_ = v(i, j) = ADAM_BETA2 * v(i, j) + (1.0 - ADAM_BETA2) * (loss * loss);
-			return lr_t * m_ / (sqrt(v_) + ADAM_EPSILON);
+		void release_batch(Replica& rep) {
+			layout::release(rep.batch_prop_delta);
+			layout::release(rep.batch_delta);
+			layout::release(rep.batch_df);
+			if (mixed) layout::release(rep.batch_z);
+			layout::release(rep.batch_f);
 		}
-#elif defined(OPTIMIZE_RMSPROP)
-		NUM_TYPE& g(unsigned int from, unsigned int to) const {
-			assert(from <= inputs && to < outputs);
-			return last_g[to * inputs + from];
-		}
-		NUM_TYPE* last_g;
-
-		NUM_TYPE learning_rate = INITIAL_LEARNING_RATE;
 
-		NUM_TYPE weight_diff(int i, int j, NUM_TYPE loss) {
-			NUM_TYPE g_ = g(i, j) = RMSPROP_RHO * g(i, j) + (1.0 - RMSPROP_RHO) * (loss * loss);
-			return learning_rate * loss / (sqrt(g_) + RMSPROP_EPSILON);
+		/** Grows the minibatch buffers of the replica to hold at least `n` samples. */
+		void reserve_batch(Replica& rep, int n) {
+			if (n <= rep.batch_capacity) return;
+
+			release_batch(rep);
+			rep.batch_f = layout::allocate<S>(n * output_stride);
+			rep.batch_z = mixed ? layout::allocate<T>(n * output_stride) : reinterpret_cast<T*>(rep.batch_f);
+			rep.batch_df = layout::allocate<T>(n * outputs);
+			rep.batch_delta = layout::allocate<T>(n * outputs);
+			rep.batch_prop_delta = layout::allocate<T>(n * input_stride);
+			rep.batch_capacity = n;
 		}
-#elif defined(OPTIMIZE_ADAGRAD)
-		NUM_TYPE& g(unsigned int from, unsigned int to) const {
-			assert(from <= inputs && to < outputs);
-			return last_g[to * inputs + from];
-		}
-		NUM_TYPE* last_g;
-		
-		NUM_TYPE learning_rate = INITIAL_LEARNING_RATE;
 
-		NUM_TYPE weight_diff(int i, int j, NUM_TYPE loss) {
-			NUM_TYPE g_ = g(i, j) += loss * loss;
-			return learning_rate * loss / (sqrt(g_) + ADAGRAD_EPSILON);
+		/**
+		 * f = activation(z) over `n` elements, in place when S is T, and df = f'(z) unless `df` is NULL.
+		 * The activation works on the whole array at once, instead of being called per element.
+		 */
+		void activate(T* z, S* f, T* df, int n) {
+			if (df) activation.apply_with_derivative(z, z, df, n);
+			else activation.apply(z, z, n);
+			if (mixed) kernel::ops<T, S>().narrow(n, z, f);
 		}
-#elif defined(OPTIMIZE_NESTEROV)
-		NUM_TYPE& v(unsigned int from, unsigned int to) const {
-			assert(from <= inputs && to < outputs);
-			return last_v[to * inputs + from];
+
+		/** Weight from the input `from` to the output `to`. `from == inputs` is the bias. */
+		T& weight(int from, int to) const {
+			assert(from >= 0 && from <= inputs && to >= 0 && to < outputs);
+			if (from == inputs) return biases[to];
+			/* Row of the inputs per output, to be read contiguously by the forward propagation and the weight update. */
+			return weights[to * input_stride + from];
 		}
-		NUM_TYPE* last_v;
 
-		NUM_TYPE learning_rate = INITIAL_LEARNING_RATE;
+		/* `weights` and the optimizer states hold [outputs x input_stride] weights, then `output_stride` biases from `bias_offset`. */
+		const int bias_offset;
+		const int param_count;
+		T* weights;
+		/* Weights rounded to S, read by the propagation. Same array as `weights` unless mixed. */
+		S* weights_lp;
+		T* biases;
 
-		NUM_TYPE weight_diff(int i, int j, NUM_TYPE loss) {
-			NUM_TYPE prev_v = v(i, j);
-			NUM_TYPE v_ = v(i, j) = NESTEROV_MOMENTUM_FACTOR * prev_v - learning_rate * loss;
-			return NESTEROV_MOMENTUM_FACTOR * prev_v - (1 + NESTEROV_MOMENTUM_FACTOR) * v_;
-		}
-#elif defined(OPTIMIZE_MOMENTUM)
-		NUM_TYPE& velocity(unsigned int from, unsigned int to) const {
-			assert(from <= inputs && to < outputs);
-			return last_v[to * inputs + from];
-		}
-		NUM_TYPE* last_v;
+		optimizer::Optimizer<T> weight_optimizer;
+
+		static const bool mixed = !std::is_same<T, S>::value;
 
-		NUM_TYPE learning_rate = INITIAL_LEARNING_RATE;
+		/* Rough costs per element in multiply-adds, for `ThreadPool::plan()`: an activation with its derivative, and an optimizer update */
+		static const int ACTIVATION_COST = 16;
+		static const int UPDATE_COST = 4;
+
+		/* Threads to split the work over, NULL to run it all on the calling thread */
+		ThreadPool* pool;
+
+		/**
+		 * Scale of the stored weights and biases, the real weights being `weight_scale * weights`.
+		 * Kept in double, as the decay of a step is usually below the precision of float. Always 1 without `LAZY_WEIGHT_DECAY`.
+		 */
+		double weight_scale;
 
-		NUM_TYPE weight_diff(int i, int j, NUM_TYPE loss) {
-			return velocity(i, j) = MOMENTUM_MOMENTUM_FACTOR * velocity(i, j) + learning_rate * loss;
+		/** Rounds all the master weights into `weights_lp` */
+		void round_weights() {
+			if (mixed) kernel::ops<T, S>().narrow(param_count, weights, weights_lp);
 		}
-#else
-		NUM_TYPE learning_rate = INITIAL_LEARNING_RATE;
-		NUM_TYPE weight_diff(int i, int j, NUM_TYPE loss) {
-			return learning_rate * loss;
+
+#ifdef LAZY_WEIGHT_DECAY
+		/** Multiplies the scale into the stored weights, back to `weight_scale` = 1. The optimizer states don't depend on the scale. */
+		void renormalize() {
+			const T scale = (T) weight_scale;
+			parallel_for(pool, param_count, param_count, [&](int begin, int end) {
+				for (int i = begin; i < end; i++) {
+					weights[i] *= scale;
+				}
+			});
+			round_weights();
+			weight_scale = 1;
 		}
 #endif
 
-#ifdef LEARNING_RATE_DECAY
-		NUM_TYPE decay_factor = 1;
-#endif
-		/* End optimizer implementation */
+		/* Runs the fused optimizer kernel over `n` contiguous weights from `offset`, and their optimizer state at the same offset. */
+		void update_row(int offset, int n, const T* g, const kernel::UpdateParams<T>& p) {
+			weight_optimizer.update(weights, offset, n, g, p);
+		}
 
-		NUM_TYPE* last_f;
-		NUM_TYPE* last_delta;
-		NUM_TYPE* last_prop_delta;
-#ifdef BATCH_TRAIN
-		NUM_TYPE* delta_sum;
-		int batch_count;
+		S* last_f;
+		/* Pre-activation of `last_f` in T, the same array as `last_f` unless mixed */
+		T* last_z;
+		/* Activation derivative f'(z) of the last training `forward()` */
+		T* last_df;
+		T* last_delta;
+		T* last_prop_delta;
+#ifndef BATCH_TRAIN
+		/* `update_weights()` input widened to T, only when mixed */
+		T* input_buf;
 #endif
 
 		Activation activation;
@@ -349,8 +655,8 @@ namespace nn {
 			double u1, u2;
 			do
 			{
-				u1 = rand() * (1.0 / RAND_MAX);
-				u2 = rand() * (1.0 / RAND_MAX);
+				u1 = Random::local().uniform();
+				u2 = Random::local().uniform();
 			} while (u1 <= epsilon);
 
 			double z0;
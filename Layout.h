@@ -0,0 +1,61 @@
+#pragma once
+
+/**
+ * Memory layout of the matrices passed to the kernels.
+ * Every row starts on a 64-byte boundary(a cache line, and a full AVX-512 register) and is padded with zeros up to `stride()` elements.
+ * The kernels can run over the whole padded row, which is a multiple of the vector width, so the padding contributes zero and no tail is left behind.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+namespace nn {
+	namespace layout {
+		/* Alignment of every allocation and row, in bytes */
+		static const int ALIGNMENT = 64;
+
+		/**
+		 * Number of elements of S a row of `n` elements is padded to.
+		 * Rows of a wider type(e.g. the float master weights of a bf16 layer) with the same stride stay aligned as well.
+		 */
+		template<typename S>
+		inline int stride(int n) {
+			const int width = ALIGNMENT / sizeof(S);
+			return (n + width - 1) / width * width;
+		}
+
+		/**
+		 * Allocates `n` zero-filled elements aligned to `ALIGNMENT`. Only for the plain scalar types.
+		 * @throws std::bad_alloc if the allocation fails.
+		 * @returns The array, which must be freed with `release()`.
+		 */
+		template<typename T>
+		T* allocate(size_t n) {
+			const size_t size = (n > 0 ? n : 1) * sizeof(T);
+#ifdef _MSC_VER
+			void* p = _aligned_malloc(size, ALIGNMENT);
+			if (!p) throw std::bad_alloc();
+#else
+			void* p;
+			if (posix_memalign(&p, ALIGNMENT, size) != 0) throw std::bad_alloc();
+#endif
+			memset(p, 0, size);
+			return static_cast<T*>(p);
+		}
+
+		/** Frees an array from `allocate()`. NULL is ignored. */
+		template<typename T>
+		void release(T* p) {
+#ifdef _MSC_VER
+			_aligned_free(p);
+#else
+			free(p);
+#endif
+		}
+	}
+}
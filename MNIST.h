@@ -1,9 +1,11 @@
 #pragma once
 
 #include "Dataset.h"
+#include "TextLoader.h"
 
 namespace nn {
-	class MNIST : public Dataset {
+	template<typename T = NUM_TYPE>
+	class MNIST : public Dataset<T> {
 	public:
 		static const int INPUTS = 784, OUTPUTS = 10;
 
@@ -11,48 +13,28 @@ namespace nn {
 			: train(train_file), test(test_file)
 		{}
 
-		std::vector<DataEntry> get_train_set() {
-			int label;
-			FILE* mnist_train = fopen(train, "r");
-			std::vector<DataEntry> dataset;
-			while (fscanf(mnist_train, "%d", &label) > 0) {
-				DataEntry entry(INPUTS, OUTPUTS);
-
-				for (int i = 0; i < OUTPUTS; i++) {
-					entry.label[i] = (label == i) ? 1 : 0;
-				}
-
-				for (int i = 0; i < INPUTS; i++) {
-					fscanf(mnist_train, "%lf", &entry.data[i]);
-					entry.data[i] /= 255.0;
-				}
-
-				dataset.push_back(std::move(entry));
-			}
-			return dataset;
+		std::vector<DataEntry<T>> get_train_set() override {
+			return to_entries<T>(get_train_samples());
 		}
 
-		std::vector<DataEntry> get_test_set() {
-			int label;
-			FILE* mnist_test = fopen(test, "r");
-			std::vector<DataEntry> dataset;
-			while (fscanf(mnist_test, "%d", &label) > 0) {
-				DataEntry entry(INPUTS, OUTPUTS);
-
-				for (int i = 0; i < OUTPUTS; i++) {
-					entry.label[i] = (label == i) ? 1 : 0;
-				}
-
-				for (int i = 0; i < INPUTS; i++) {
-					fscanf(mnist_test, "%lf", &entry.data[i]);
-					entry.data[i] /= 255.0;
-				}
-
-				dataset.push_back(std::move(entry));
-			}
-			return dataset;
+		std::vector<DataEntry<T>> get_test_set() override {
+			return to_entries<T>(get_test_samples());
+		}
+
+		SampleSet get_train_samples() override {
+			return load_text(train, FORMAT);
+		}
+
+		SampleSet get_test_samples() override {
+			return load_text(test, FORMAT);
 		}
 	private:
+		/* A label followed by the 784 pixels in 0~255, separated by whitespace, e.g. a line of the label and 28 lines of 28 pixels. */
+		static const TextFormat FORMAT;
+
 		const char *train, *test;
 	};
+
+	template<typename T>
+	const TextFormat MNIST<T>::FORMAT = { MNIST<T>::INPUTS, MNIST<T>::OUTPUTS, 1 / 255.0, 785, 1, NULL };
 }
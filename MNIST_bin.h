@@ -2,57 +2,78 @@
 #define _CRT_SECURE_NO_WARNINGS
 
 #include "Dataset.h"
+#include <cstddef>
 #include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 namespace nn {
-	class MNIST_bin : public Dataset {
+	template<typename T = NUM_TYPE>
+	class MNIST_bin : public Dataset<T> {
 	public:
 		static const int INPUTS = 784, OUTPUTS = 10;
 
-		MNIST_bin(const char* train_file, const char* test_file)
-			: train(train_file), test(test_file)
+		/**
+		 * @param shard, shard_count Loads only the train entries i with `i % shard_count == shard`, for one of `shard_count` trainer processes.
+		 */
+		MNIST_bin(const char* train_file, const char* test_file, int shard = 0, int shard_count = 1)
+			: train(train_file), test(test_file), shard(shard), shard_count(shard_count)
 		{}
 
-		std::vector<DataEntry> get_train_set() override {
-			FILE* mnist_train = fopen(train, "rb");
-			std::vector<DataEntry> dataset;
-
-			mnist_entry item;
-			while (fread(&item, sizeof(item), 1, mnist_train) > 0) {
-				DataEntry entry(INPUTS, OUTPUTS);
-
-				for (int i = 0; i < OUTPUTS; i++) {
-					entry.label[i] = (item.label == i) ? 1 : 0;
-				}
-
-				for (int i = 0; i < INPUTS; i++) {
-					entry.data[i] = item.data[i] / 255.0;
-				}
-
-				dataset.push_back(std::move(entry));
-			}
-			return dataset;
+		std::vector<DataEntry<T>> get_train_set() override {
+			return to_entries<T>(get_train_samples());
 		}
 
-		std::vector<DataEntry> get_test_set() override {
-			FILE* mnist_test = fopen(test, "rb");
-			std::vector<DataEntry> dataset;
+		std::vector<DataEntry<T>> get_test_set() override {
+			return to_entries<T>(get_test_samples());
+		}
 
-			mnist_entry item;
-			while (fread(&item, sizeof(item), 1, mnist_test) > 0) {
-				DataEntry entry(INPUTS, OUTPUTS);
+		/**
+		 * Maps the train file, and reads the shard in place.
+		 * @throws std::runtime_error if the file cannot be mapped, is not a whole number of entries, or has an invalid label.
+		 */
+		SampleSet get_train_samples() override {
+			return map_samples(train, shard, shard_count);
+		}
 
-				for (int i = 0; i < OUTPUTS; i++) {
-					entry.label[i] = (item.label == i) ? 1 : 0;
-				}
+		/** Maps the test file, see `get_train_samples()`. */
+		SampleSet get_test_samples() override {
+			return map_samples(test, 0, 1);
+		}
 
-				for (int i = 0; i < INPUTS; i++) {
-					entry.data[i] = item.data[i] / 255.0;
-				}
+		/**
+		 * Maps a file of this format, and reads the entries i with `i % count == part` in place, as every `count`-th entry from `part`.
+		 * @throws std::runtime_error if the file cannot be mapped, is not a whole number of entries, or has a label out of 0~9.
+		 */
+		static SampleSet map_samples(const char* file, int part = 0, int count = 1) {
+			std::shared_ptr<MappedFile> mapped = MappedFile::open(file);
+			if (mapped->size() % sizeof(mnist_entry) != 0)
+				throw std::runtime_error(std::string(file) + " is not a MNIST binary file");
+			/* The shuffled batches touch the pages all over, so read them all ahead in the background */
+			mapped->advise(0, mapped->size(), MappedFile::WillNeed);
 
-				dataset.push_back(std::move(entry));
+			const size_t entries = mapped->size() / sizeof(mnist_entry);
+			const size_t samples = (entries > (size_t) part) ? (entries - part + count - 1) / count : 0;
+			const unsigned char* first = mapped->data() + part * sizeof(mnist_entry);
+			SampleSet set = SampleSet::view(INPUTS, OUTPUTS, 1 / 255.0, samples,
+				mapped, first + offsetof(mnist_entry, data), count * sizeof(mnist_entry),
+				mapped, first + offsetof(mnist_entry, label), count * sizeof(mnist_entry), sizeof(int));
+			/* The labels index the outputs, so a foreign file must not get past here */
+			for (size_t i = 0; i < set.size(); i++) {
+				const int label = set.label(i);
+				if (label < 0 || label >= OUTPUTS) throw std::runtime_error(std::string(file) + " has an invalid label");
 			}
-			return dataset;
+			return set;
+		}
+
+		/**
+		 * Streams files of this format, e.g. the shards of a set too large to be held in memory.
+		 * @throws std::runtime_error if a file cannot be opened, or is not a whole number of entries.
+		 */
+		static std::unique_ptr<SampleStream> open_stream(const std::vector<std::string>& files, size_t buffer_size) {
+			return std::unique_ptr<SampleStream>(new SampleStream(files, INPUTS, OUTPUTS, 1 / 255.0,
+				sizeof(mnist_entry), offsetof(mnist_entry, data), offsetof(mnist_entry, label), sizeof(int), buffer_size));
 		}
 	private:
 		struct mnist_entry {
@@ -60,5 +81,6 @@ namespace nn {
 			unsigned char data[INPUTS];
 		};
 		const char *train, *test;
+		const int shard, shard_count;
 	};
 }
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "Dataset.h"
+#include <stdexcept>
+#include <string>
+
+namespace nn {
+	/**
+	 * The original MNIST files in the IDX format, read in place from their memory mappings without any conversion.
+	 * The images are `train-images-idx3-ubyte` and `t10k-images-idx3-ubyte`, and their labels `train-labels-idx1-ubyte` and `t10k-labels-idx1-ubyte`.
+	 */
+	template<typename T = NUM_TYPE>
+	class MNIST_idx : public Dataset<T> {
+	public:
+		static const int INPUTS = 784, OUTPUTS = 10;
+
+		/**
+		 * @param directory Directory of the four files.
+		 * @param shard, shard_count Loads only the train images i with `i % shard_count == shard`, for one of `shard_count` trainer processes.
+		 */
+		MNIST_idx(const std::string& directory = ".", int shard = 0, int shard_count = 1)
+			: directory(directory), shard(shard), shard_count(shard_count)
+		{}
+
+		std::vector<DataEntry<T>> get_train_set() override {
+			return to_entries<T>(get_train_samples());
+		}
+
+		std::vector<DataEntry<T>> get_test_set() override {
+			return to_entries<T>(get_test_samples());
+		}
+
+		/**
+		 * Maps the train images and labels, and reads the shard in place.
+		 * @throws std::runtime_error if a file cannot be mapped, or its header or labels are invalid.
+		 */
+		SampleSet get_train_samples() override {
+			return map_samples("train", shard, shard_count);
+		}
+
+		/** Maps the test images and labels, see `get_train_samples()`. */
+		SampleSet get_test_samples() override {
+			return map_samples("t10k", 0, 1);
+		}
+	private:
+		/* Magic numbers of the headers: unsigned byte data, with 3 and 1 dimensions */
+		static const unsigned int IMAGES_MAGIC = 0x00000803, LABELS_MAGIC = 0x00000801;
+
+		const std::string directory;
+		const int shard, shard_count;
+
+		/* The IDX headers are big-endian 32-bit integers */
+		static unsigned int read_u32(const unsigned char* p) {
+			return ((unsigned int) p[0] << 24) | ((unsigned int) p[1] << 16) | ((unsigned int) p[2] << 8) | p[3];
+		}
+
+		SampleSet map_samples(const std::string& prefix, int part, int count) const {
+			const std::string images_path = directory + "/" + prefix + "-images-idx3-ubyte";
+			const std::string labels_path = directory + "/" + prefix + "-labels-idx1-ubyte";
+			std::shared_ptr<MappedFile> images = MappedFile::open(images_path.c_str());
+			std::shared_ptr<MappedFile> labels = MappedFile::open(labels_path.c_str());
+
+			/* magic, count, rows, columns */
+			if (images->size() < 16 || read_u32(images->data()) != IMAGES_MAGIC)
+				throw std::runtime_error(images_path + " is not an IDX image file");
+			const size_t size = read_u32(images->data() + 4);
+			if (read_u32(images->data() + 8) * read_u32(images->data() + 12) != (unsigned int) INPUTS)
+				throw std::runtime_error(images_path + " doesn't have 28x28 images");
+			if (images->size() < 16 + size * INPUTS)
+				throw std::runtime_error(images_path + " is shorter than its header");
+
+			/* magic, count */
+			if (labels->size() < 8 || read_u32(labels->data()) != LABELS_MAGIC)
+				throw std::runtime_error(labels_path + " is not an IDX label file");
+			if (read_u32(labels->data() + 4) != size || labels->size() < 8 + size)
+				throw std::runtime_error(labels_path + " doesn't match the images");
+			/* The labels are small enough to check all, and they're read right away anyway */
+			for (size_t i = 0; i < size; i++) {
+				if (labels->data()[8 + i] >= OUTPUTS) throw std::runtime_error(labels_path + " has an invalid label");
+			}
+
+			/* The shuffled batches touch the images all over, so read them all ahead in the background */
+			images->advise(16, size * INPUTS, MappedFile::WillNeed);
+
+			const size_t samples = (size > (size_t) part) ? (size - part + count - 1) / count : 0;
+			return SampleSet::view(INPUTS, OUTPUTS, 1 / 255.0, samples,
+				images, images->data() + 16 + part * INPUTS, count * INPUTS,
+				labels, labels->data() + 8 + part, count, 1);
+		}
+	};
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "MNIST_bin.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+namespace nn {
+	/**
+	 * A train set split into a directory of shards in the format of `MNIST_bin`, all the `.bin` files of the directory, streamed to be trained on in passes.
+	 * The test set is a single file of the same format, mapped as a whole.
+	 */
+	template<typename T = NUM_TYPE>
+	class MNIST_shards : public Dataset<T> {
+	public:
+		static const int INPUTS = MNIST_bin<T>::INPUTS, OUTPUTS = MNIST_bin<T>::OUTPUTS;
+
+		/**
+		 * @param shard, shard_count Streams only the files i of the directory with `i % shard_count == shard`, in the order of their names,
+		 *                           for one of `shard_count` trainer processes.
+		 */
+		MNIST_shards(const std::string& directory, const char* test_file, int shard = 0, int shard_count = 1)
+			: directory(directory), test(test_file), shard(shard), shard_count(shard_count)
+		{}
+
+		std::vector<DataEntry<T>> get_train_set() override {
+			return to_entries<T>(get_train_samples());
+		}
+
+		std::vector<DataEntry<T>> get_test_set() override {
+			return to_entries<T>(get_test_samples());
+		}
+
+		/** Reads a whole pass of the train stream into memory, only for the sets that fit. */
+		SampleSet get_train_samples() override {
+			std::unique_ptr<SampleStream> stream = open_train_stream(1);
+			SampleSet samples(INPUTS, OUTPUTS);
+			stream->next(samples, stream->size());
+			return samples;
+		}
+
+		SampleSet get_test_samples() override {
+			return MNIST_bin<T>::map_samples(test);
+		}
+
+		/**
+		 * Opens the shards of the process as a stream.
+		 * @throws std::runtime_error if the directory cannot be read, has no shard for the process, or a shard is invalid.
+		 */
+		std::unique_ptr<SampleStream> open_train_stream(size_t buffer_size) override {
+			std::vector<std::string> files = list(directory, ".bin");
+			std::vector<std::string> part;
+			for (size_t i = shard; i < files.size(); i += shard_count) {
+				part.push_back(directory + "/" + files[i]);
+			}
+			if (part.empty()) throw std::runtime_error("No shard in " + directory + " for the process");
+			return MNIST_bin<T>::open_stream(part, buffer_size);
+		}
+	private:
+		const std::string directory;
+		const char* test;
+		const int shard, shard_count;
+
+		/* Names of the files in `directory` ending with `suffix`, sorted */
+		static std::vector<std::string> list(const std::string& directory, const std::string& suffix) {
+			std::vector<std::string> names;
+#ifdef _WIN32
+			WIN32_FIND_DATAA found;
+			HANDLE find = FindFirstFileA((directory + "\\*" + suffix).c_str(), &found);
+			if (find == INVALID_HANDLE_VALUE) throw std::runtime_error("Cannot read the directory " + directory);
+			do {
+				if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) names.push_back(found.cFileName);
+			} while (FindNextFileA(find, &found));
+			FindClose(find);
+#else
+			DIR* dir = opendir(directory.c_str());
+			if (!dir) throw std::runtime_error("Cannot read the directory " + directory);
+			while (struct dirent* entry = readdir(dir)) {
+				const std::string name = entry->d_name;
+				if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+					names.push_back(name);
+				}
+			}
+			closedir(dir);
+#endif
+			std::sort(names.begin(), names.end());
+			return names;
+		}
+	};
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+/**
+ * Read-only memory mapping of a whole file, for the datasets read in place(see `SampleSet::view()`).
+ * The pages are loaded by the OS on first touch and shared through the page cache, so the processes mapping the same file keep a single copy.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace nn {
+	class MappedFile {
+	public:
+		/** Access patterns to hint the OS with, see `advise()` */
+		enum Access {
+			Sequential,
+			Random,
+			/* Read ahead the whole range in the background */
+			WillNeed,
+		};
+
+		/**
+		 * Maps the whole file.
+		 * @throws std::runtime_error if the file cannot be opened or mapped.
+		 */
+		static std::shared_ptr<MappedFile> open(const char* path) {
+			return std::shared_ptr<MappedFile>(new MappedFile(path));
+		}
+
+		~MappedFile() {
+#ifdef _WIN32
+			if (base) UnmapViewOfFile(base);
+#else
+			if (base) munmap(base, size_);
+#endif
+		}
+
+		const unsigned char* data() const {
+			return static_cast<const unsigned char*>(base);
+		}
+
+		size_t size() const {
+			return size_;
+		}
+
+		/** Hints the OS how the bytes [offset, offset + n) are going to be read. Ignored where not supported. */
+		void advise(size_t offset, size_t n, Access access) const {
+#ifndef _WIN32
+			/* madvise() takes a page-aligned start */
+			const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+			const size_t begin = offset / page * page;
+			if (n == 0 || begin >= size_) return;
+			const int advice = (access == Sequential) ? MADV_SEQUENTIAL : (access == Random) ? MADV_RANDOM : MADV_WILLNEED;
+			madvise(static_cast<char*>(base) + begin, std::min(offset + n, size_) - begin, advice);
+#else
+			(void) offset, (void) n, (void) access;
+#endif
+		}
+
+	private:
+		void* base;
+		size_t size_;
+
+		explicit MappedFile(const char* path) : base(NULL), size_(0) {
+#ifdef _WIN32
+			HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (file == INVALID_HANDLE_VALUE) throw std::runtime_error(std::string("Cannot open ") + path);
+			LARGE_INTEGER length;
+			GetFileSizeEx(file, &length);
+			size_ = (size_t) length.QuadPart;
+			if (size_ > 0) {
+				HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+				if (mapping) {
+					base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+					CloseHandle(mapping);
+				}
+			}
+			CloseHandle(file);
+			if (size_ > 0 && !base) throw std::runtime_error(std::string("Cannot map ") + path);
+#else
+			int fd = ::open(path, O_RDONLY);
+			if (fd < 0) throw std::runtime_error(std::string("Cannot open ") + path);
+			struct stat st;
+			if (fstat(fd, &st) == 0) size_ = (size_t) st.st_size;
+			if (size_ > 0) {
+				base = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+				if (base == MAP_FAILED) base = NULL;
+			}
+			/* The mapping keeps the file */
+			close(fd);
+			if (size_ > 0 && !base) throw std::runtime_error(std::string("Cannot map ") + path);
+#endif
+		}
+
+		MappedFile(const MappedFile&);
+		MappedFile& operator=(const MappedFile&);
+	};
+}
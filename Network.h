@@ -2,24 +2,69 @@
 
 /**
  * Defines layer and network data types for the neural network.
- * Note that the result arrays returned(NUM_TYPE* type return values) must not be modified.
+ * Note that the result arrays returned(T* type return values) must not be modified.
  **/
 
 #include "Config.h"
 #include "Activation.h"
 #include "Layer.h"
+#include "Optimizer.h"
+#include "ThreadPool.h"
+#include "ProcessGroup.h"
 #include "Dataset.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <cassert>
 #include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 namespace nn {
 
+	/*
+	 * Checkpoint headers. The legacy "NeNet" header is always followed by float64 weights,
+	 * while the "NeNt2" header is followed by a byte of `scalar_types` that the weights are stored in.
+	 */
+	static const char CHECKPOINT_MAGIC_V1[] = "NeNet";
+	static const char CHECKPOINT_MAGIC_V2[] = "NeNt2";
+
+	/**
+	 * Reads the scalar type of the network saved in the stream, without consuming the stream.
+	 * @returns One of `scalar_types`, or -1 if the stream is not a valid network.
+	 */
+	inline int checkpoint_scalar_type(std::istream& input) {
+		std::streampos pos = input.tellg();
+		char magic[6];
+		input.read(magic, 5);
+		magic[5] = '\0';
+
+		int type = -1;
+		if (!input.fail()) {
+			if (strcmp(magic, CHECKPOINT_MAGIC_V1) == 0) {
+				type = scalar_types::Float64;
+			} else if (strcmp(magic, CHECKPOINT_MAGIC_V2) == 0) {
+				char stored;
+				input.read(&stored, sizeof(stored));
+				if (!input.fail()) type = stored;
+			}
+		}
+
+		input.clear();
+		input.seekg(pos);
+		return type;
+	}
+
 	/**
 	 * The neural network.
 	 * Composed of the layers, this class contains the operation for them including train and test(predict).
+	 * All the weights, activations and optimizer states are kept in scalar type T.
+	 * With S of `bf16` or `fp16`(T must be float), the layers read their weights and pass the outputs in S instead, while the optimizer keeps updating the weights in T.
 	 */
+	template<typename T = NUM_TYPE, typename S = T>
 	class Network {
 	public:
 		class Builder {
@@ -54,7 +99,7 @@ namespace nn {
 					throw std::invalid_argument("Neuron count cannot be zero, maybe you missed the call to Builder::input()");
 				}
 
-				Layer* layer = new LayerImpl<A>(last_size, neurons);
+				Layer<T, S>* layer = new LayerImpl<A, T, S>(last_size, neurons);
 				layer->initialize_weights();
 
 				LayerList* list = new LayerList;
@@ -74,23 +119,25 @@ namespace nn {
 			}
 			/**
 			 * Builds the network.
+			 * @param threads Worker threads the network starts with, see `set_threads()`.
 			 * @throws std::length_error when `build()` is called with no layers added.
 			 * @returns The network built.
 			 */
-			Network* build() {
+			Network* build(int threads = 0) {
 				if (count <= 0) throw std::length_error("No layers present in the network definition!");
-				Layer** layers = new Layer*[count];
+				Layer<T, S>** layers = new Layer<T, S>*[count];
 				LayerList* curr = head;
 				for(unsigned int i = 0; i < count && curr != NULL; i++, curr = curr->next) {
 					layers[i] = curr->layer;
 				}
 
-				Network* net = new Network(count, layers, input_size, tail->output_size);
+				Network* net = new Network(count, layers, input_size, tail->output_size, threads);
 				//delete this;
 				return net;
 			}
 			/**
 			 * Loads a network from stream.
+			 * The weights are converted to T if the network was saved with the other scalar type.
 			 * This method can be called alone, or with other layers before or after the `load()` call.
 			 * By combining other layers, the network can be pre-trained per each layers.
 			 * @param input The input stream to read from.
@@ -100,16 +147,21 @@ namespace nn {
 			 * @returns this, for chaining.
 			 */
 			Builder& load(std::istream& input) {
-				char magic[6];
-				input.read(magic, 5);
-				magic[5] = '\0';
-				if (input.fail() || strcmp(magic, "NeNet") != 0)
+				const int stored_type = checkpoint_scalar_type(input);
+				if (stored_type < scalar_types::Float64 || stored_type > scalar_types::Float16)
 					throw std::invalid_argument("The input is not a network save file");
 
+				char magic[5];
+				input.read(magic, 5);
+				if (strncmp(magic, CHECKPOINT_MAGIC_V2, 5) == 0) {
+					char stored;
+					input.read(&stored, sizeof(stored));
+				}
+
 				int layers;
 				input.read((char*) &layers, sizeof(layers));
 
-				NUM_TYPE* weight_buf = NULL;
+				T* weight_buf = NULL;
 				int buf_size = -1;
 
 				for (int i = 0; i < layers; i++) {
@@ -128,34 +180,38 @@ namespace nn {
 					assert(!input.fail());
 
 					if (weight_count > buf_size) {
-						NUM_TYPE* newbuf = new NUM_TYPE[weight_count];
+						T* newbuf = new T[weight_count];
 						delete[] weight_buf;
 						weight_buf = newbuf;
 						buf_size = weight_count;
 					}
 
-					input.read((char*) weight_buf, sizeof(NUM_TYPE) * weight_count);
+					if (stored_type == scalar_types::Float64) {
+						read_weights<double>(input, weight_buf, weight_count);
+					} else {
+						read_weights<float>(input, weight_buf, weight_count);
+					}
 					assert(!input.fail());
 
-					Layer* layer;
+					Layer<T, S>* layer;
 					switch(type) {
 					case activation::types::Sigmoid:
-						layer = new LayerImpl<activation::Sigmoid>(in, out);
+						layer = new LayerImpl<activation::Sigmoid, T, S>(in, out);
 						break;
 					case activation::types::Tanh:
-						layer = new LayerImpl<activation::Tanh>(in, out);
+						layer = new LayerImpl<activation::Tanh, T, S>(in, out);
 						break;
 					case activation::types::HardSigmoid:
-						layer = new LayerImpl<activation::HardSigmoid>(in, out);
+						layer = new LayerImpl<activation::HardSigmoid, T, S>(in, out);
 						break;
 					case activation::types::ReLU:
-						layer = new LayerImpl<activation::ReLU>(in, out);
+						layer = new LayerImpl<activation::ReLU, T, S>(in, out);
 						break;
 					case activation::types::LeakyReLU:
-						layer = new LayerImpl<activation::LeakyReLU>(in, out);
+						layer = new LayerImpl<activation::LeakyReLU, T, S>(in, out);
 						break;
 					case activation::types::ELU:
-						layer = new LayerImpl<activation::ELU>(in, out);
+						layer = new LayerImpl<activation::ELU, T, S>(in, out);
 						break;
 					default:
 						throw std::runtime_error("Invalid activation function type!");
@@ -210,8 +266,22 @@ namespace nn {
 				delete_list();
 			}
 		private:
+			/* Reads `count` weights stored as U, converting them to T */
+			template<typename U>
+			static void read_weights(std::istream& input, T* out, int count) {
+				if (sizeof(U) == sizeof(T)) {
+					input.read((char*) out, sizeof(T) * count);
+					return;
+				}
+				std::vector<U> stored(count);
+				input.read((char*) stored.data(), sizeof(U) * count);
+				for (int i = 0; i < count; i++) {
+					out[i] = (T) stored[i];
+				}
+			}
+
 			struct LayerList {
-				Layer* layer;
+				Layer<T, S>* layer;
 				unsigned int output_size;
 				LayerList* next;
 			} *head, *tail;
@@ -234,84 +304,297 @@ namespace nn {
 			}
 		};
 
+		/**
+		 * Buffers of `infer()`, owned by the caller, so the threads running the same network each need one of their own.
+		 * Sized once from the layers of the network, and never grown: batches larger than `capacity` are propagated in parts.
+		 */
+		class Workspace {
+		public:
+			/** @param capacity Samples propagated at a time by `infer_batch()`. */
+			explicit Workspace(const Network& network, unsigned int capacity = 1)
+				: capacity(std::max(capacity, 1u)), input(layout::allocate<S>((size_t) this->capacity * network.input_stride))
+			{
+				for (int i = 0; i < network.layer_count; i++) {
+					const Layer<T, S>* layer = network.layers[i];
+					f.push_back(layout::allocate<S>((size_t) this->capacity * layer->output_stride));
+					z.push_back(mixed ? layout::allocate<T>((size_t) this->capacity * layer->output_stride) : reinterpret_cast<T*>(f.back()));
+				}
+			}
+
+			~Workspace() {
+				for (size_t i = 0; i < f.size(); i++) {
+					if (mixed) layout::release(z[i]);
+					layout::release(f[i]);
+				}
+				layout::release(input);
+			}
+
+			const unsigned int capacity;
+
+		private:
+			friend class Network;
+
+			/* Row-major [capacity x stride] inputs, and the outputs of each layer with their pre-activation in T(the same arrays unless mixed) */
+			S* input;
+			std::vector<S*> f;
+			std::vector<T*> z;
+
+			Workspace(const Workspace&);
+			Workspace& operator=(const Workspace&);
+		};
+
 		/**
 		 * Trains the network with the given data batch of size `n`.
-		 * TODO: implement batch weight update, instead of one update per single data entry.
+		 * With `BATCH_TRAIN`, the whole batch is gathered into a single matrix and propagated through `Layer::forward_batch()`/`backward_batch()`, then the weights are updated once.
+		 * With data-parallel shards(see `set_data_parallel()`), the shards of the batch are propagated at the same time before their gradients are reduced for the update.
+		 * With a pipeline(see `set_pipeline()`), the batch is split into micro-batches flowing through the stages of the layers instead.
+		 * With a process group(see `set_process_group()`), the gradients are then summed up over the batches of all the processes, and every process takes the same step.
+		 * Otherwise the weights are updated once per single data entry.
 		 * @param n Number of data to read from the `data` array.
 		 * @param data Data array used to train the network.
 		 */
-		void train(unsigned int n, DataEntry* data) {
+		void train(unsigned int n, DataEntry<T>* data) {
+			train_batch(n, EntryBatch(data, inputs, outputs));
+		}
+
+		/**
+		 * Trains the network with the `n` samples of `samples` from `begin`, as `train()` of the entries.
+		 * The inputs are scaled as they're gathered into the batch, and the labels expanded to one-hot as the output delta is calculated, so the samples are read as stored.
+		 */
+		void train(unsigned int n, const SampleSet& samples, size_t begin) {
+			train_batch(n, SampleBatch(samples, begin, inputs, outputs));
+		}
+
+		/**
+		 * Trains the network with a batch gathered ahead in its storage type, e.g. by a `Prefetcher`, as `train()` of the entries.
+		 * The rows are only copied into the input of the layers.
+		 */
+		void train(const Minibatch<S>& batch) {
+			train_batch(batch.size, MinibatchRows(batch, inputs, outputs));
+		}
+
 #ifdef BATCH_TRAIN
-			for(int i = 0; i < layer_count; i++) {
-				layers[i]->clear_delta();
-			}
+		/**
+		 * Trains asynchronously over `n` entries of `data`, in the way of Hogwild!: each thread of the pool takes the next `batch_size` entries in turn,
+		 * propagates them on its own replica of the layer buffers, and updates the weights and the optimizer states right away, without locks or waiting for the others.
+		 * The updates race with each other and with the propagation on the other threads, so an update may be lost or computed from half-updated weights.
+		 * SGD tolerates these as much as the stale gradients, for the throughput without a barrier per step, but the result is not reproducible.
+		 * Only the learning rate schedule is stepped under a lock, once per update.
+		 * Not available with `LAZY_WEIGHT_DECAY`, as the threads would race on the scale of the weights and on its renormalization, which rewrites all of them.
+		 * @param batch_size Number of entries per update, the last one taking the rest if fewer.
+		 * @throws std::logic_error with `LAZY_WEIGHT_DECAY`.
+		 * @returns Number of updates applied by each thread.
+		 */
+		std::vector<int> train_async(unsigned int n, DataEntry<T>* data, unsigned int batch_size) {
+			return train_async_batch(n, EntryBatch(data, inputs, outputs), batch_size);
+		}
+
+		/** Trains asynchronously over the `n` samples of `samples` from `begin`, as `train_async()` of the entries. */
+		std::vector<int> train_async(unsigned int n, const SampleSet& samples, size_t begin, unsigned int batch_size) {
+			return train_async_batch(n, SampleBatch(samples, begin, inputs, outputs), batch_size);
+		}
 #endif
 
-			for (unsigned int i = 0; i < n; i++) {
-				assert(data[i].data_count == inputs && data[i].label_count == outputs);
+		/**
+		 * Predict using the given input, forward-propagated through the network.
+		 * @param data Input data. Asserts the length is `Network::inputs`.
+		 * @returns Predicted result, the length is same as `Network::outputs`.
+		 */
+		T* predict(T* data) {
+			/* Copied into a padded row, as the layers read whole strides */
+			reserve_batch(1);
+			kernel::ops<T, S>().narrow(inputs, data, batch_input);
+			return predict(batch_input, predict_buf);
+		}
 
-				/* Retrieve the result(f = output) of the layers */
-				results[0] = data[i].data;
-				for (int l = 0; l < layer_count; l++) {
-					results[l + 1] = layers[l]->forward(results[l], true);
+		/** Predict sample `i` of `samples`, as `predict()` of its scaled inputs. */
+		T* predict(const SampleSet& samples, size_t i) {
+			assert(samples.inputs() == inputs);
+			reserve_batch(1);
+			kernel::ops<T, S>().dequantize(inputs, samples.data(i), (T) samples.scale(), batch_input);
+			return predict(batch_input, predict_buf);
+		}
+
+		/**
+		 * Predict `n` samples of `samples` from `begin` at once, propagated as a single matrix through `Layer::forward_batch()` on the threads of the network.
+		 * Much faster than `predict()` per sample, as the weights are read once per batch instead of once per sample.
+		 * @param out Row-major [n x outputs] matrix to write the results to.
+		 */
+		void predict_batch(unsigned int n, const SampleSet& samples, size_t begin, T* out) {
+			assert(samples.inputs() == inputs);
+			reserve_batch(n);
+			const T scale = (T) samples.scale();
+			parallel_for(pool, n, (double) n * inputs, [&](int b, int e) {
+				for (int i = b; i < e; i++) {
+					kernel::ops<T, S>().dequantize(inputs, samples.data(begin + i), scale, batch_input + i * input_stride);
 				}
+			});
 
-				/* Restore to pre-allocated [outputs] sized array. The pointer is changed during the backpropagation process */
-				NUM_TYPE* delta = delta_buf;
+			S* data = batch_input;
+			for (int l = 0; l < layer_count; l++) {
+				data = layers[l]->forward_batch(n, data, false);
+			}
+			for (unsigned int i = 0; i < n; i++) {
+				kernel::ops<T, S>().widen(outputs, data + i * output_stride, out + i * outputs);
+			}
+		}
 
-				/* Calculate delta for the output layer */
-				for (int j = 0; j < outputs; j++) {
-					delta[j] = data[i].label[j] - results[layer_count][j];
-				}
+		/**
+		 * Predict as `predict()`, without touching the buffers of the network, in the workspace of the caller on the calling thread alone.
+		 * Any number of threads may infer at the same time with a workspace each, as long as the network isn't trained meanwhile.
+		 * @param data `inputs` elements.
+		 * @param out `outputs` elements to write the result to.
+		 */
+		void infer(const T* data, T* out, Workspace& ws) const {
+			infer_batch(1, data, out, ws);
+		}
 
-				/* Backpropagate and get a new delta for the next('backward') layer. */
-				for (int l = layer_count - 1; l >= 0; l--) {
-					delta = layers[l]->backward(delta);
+		/**
+		 * Predict `n` samples at once as `infer()`, through a single matrix per layer up to the capacity of the workspace at a time.
+		 * @param data Row-major [n x inputs] matrix of the inputs.
+		 * @param out Row-major [n x outputs] matrix to write the results to.
+		 */
+		void infer_batch(unsigned int n, const T* data, T* out, Workspace& ws) const {
+			const kernel::Ops<T, S>& ops = kernel::ops<T, S>();
+			for (unsigned int begin = 0; begin < n; begin += ws.capacity) {
+				const int m = (int) std::min(n - begin, ws.capacity);
+				for (int i = 0; i < m; i++) {
+					ops.narrow(inputs, data + (size_t) (begin + i) * inputs, ws.input + (size_t) i * input_stride);
 				}
 
-#ifdef BATCH_TRAIN
-			// Update after whole batch is applied
-			}
-#endif
-				/* Update weights with their optimizer */
-				#pragma omp parallel for
-				for(int l = 0; l < layer_count; l++) {
-					layers[l]->update_weights(results[l]);
+				const S* prev_f = ws.input;
+				for (int l = 0; l < layer_count; l++) {
+					layers[l]->infer(m, prev_f, ws.f[l], ws.z[l]);
+					prev_f = ws.f[l];
+				}
+				for (int i = 0; i < m; i++) {
+					ops.widen(outputs, prev_f + (size_t) i * output_stride, out + (size_t) (begin + i) * outputs);
 				}
-#ifndef BATCH_TRAIN
 			}
-#endif
 		}
 
 		/**
-		 * Predict using the given input, forward-propagated through the network.
-		 * @param data Input data. Asserts the length is `Network::inputs`.
-		 * @returns Predicted result, the length is same as `Network::outputs`.
+		 * Switches the optimizer of all the layers, restarting its states and the learning rate schedule.
+		 * A network starts with `DEFAULT_OPTIMIZER` and the hyperparameters of Config.h.
+		 * @param type One of `optimizer::types`.
+		 * @throws std::invalid_argument if `type` is unknown.
 		 */
-		NUM_TYPE* predict(NUM_TYPE* data) {
-			for(int i = 0; i < layer_count; i++) {
-				data = layers[i]->forward(data);
+		void set_optimizer(int type, const optimizer::Hyperparams& hyperparams) {
+			for (int i = 0; i < layer_count; i++) {
+				layers[i]->set_optimizer(type);
 			}
-			return data;
+			schedule = optimizer::Schedule<T>(type, hyperparams);
+		}
+		void set_optimizer(int type) {
+			set_optimizer(type, optimizer::defaults(type));
+		}
+
+		/**
+		 * Restarts the worker threads of the network. A network starts with the threads given to `Builder::build()`, by default one per hardware thread.
+		 * @param threads Number of threads including the calling one, 0 for one per hardware thread, or 1 to run everything on the calling thread.
+		 * @param cpus CPUs to pin the threads to, see `ThreadPool`. Empty leaves them to the OS.
+		 */
+		void set_threads(int threads, const std::vector<int>& cpus = std::vector<int>()) {
+			ThreadPool* old = pool;
+			pool = new ThreadPool(threads, cpus);
+			for (int i = 0; i < layer_count; i++) {
+				layers[i]->set_thread_pool(pool);
+			}
+			delete old;
+		}
+
+#ifdef BATCH_TRAIN
+		/**
+		 * Splits each training batch into `shards` parts propagated on their own thread, with a replica of the layer buffers each.
+		 * The gradients of the shards are summed up in a fixed order, so the training gives the same weights on any number of threads for the same `shards`,
+		 * though not the same bits as unsharded, as the samples are summed up in another order.
+		 * A shard runs each layer on a single thread, so this pays off over the per-layer split of the rows when the layers are too small to keep the threads busy.
+		 * @param shards Number of shards, usually `thread_count()`, or 1 to propagate the whole batch at once(the default).
+		 */
+		void set_data_parallel(int shards) {
+			if (shards < 1) shards = 1;
+			reserve_replicas(shards);
+			this->shards = shards;
+			micro_batches = 1;
+		}
+
+		/** Number of data-parallel shards of a training batch, 1 if not sharded. */
+		int data_parallel() const {
+			return shards;
+		}
+
+		/**
+		 * Trains the layers as a pipeline: the layers are split into stages of about the same cost, one per thread, and each batch into `micro_batches` parts.
+		 * A stage runs only its own layers, so their weights stay in the cache of its thread, and passes each micro-batch on as soon as it's done with it(GPipe):
+		 * the micro-batches go forward through all the stages, then backward, while the stages work on different micro-batches at the same time.
+		 * Each micro-batch is propagated on its own replica of the layer buffers, and the gradients of the replicas are summed up in a fixed order,
+		 * so the weights only depend on the number of micro-batches, as with `set_data_parallel()` of the same number.
+		 * A stage is a single thread, so the threads beyond the number of layers are left idle.
+		 * @param micro_batches Number of micro-batches, or 1 to train without the pipeline(the default). Replaces the data-parallel shards.
+		 */
+		void set_pipeline(int micro_batches) {
+			if (micro_batches < 1) micro_batches = 1;
+			reserve_replicas(micro_batches);
+			this->micro_batches = micro_batches;
+			shards = 1;
+		}
+
+		/** Number of micro-batches of the pipeline, 1 if not pipelined. */
+		int pipeline() const {
+			return micro_batches;
+		}
+
+		/** Number of pipeline stages the layers are split into, one per thread up to the number of layers. */
+		int pipeline_stages() const {
+			return std::min(layer_count, pool->size());
+		}
+
+#ifdef __linux__
+		/**
+		 * Trains along with the other processes of `group`, each `train()` taking a step with the gradients summed up over the batches of all of them.
+		 * The processes must start from the same weights and optimizer, and call `train()` the same number of times, so they keep the same weights.
+		 * @param group Group of the trainer processes, not owned, or NULL to train alone(the default).
+		 */
+		void set_process_group(ProcessGroup* group) {
+			this->group = group;
+		}
+#endif
+#endif
+
+		/** Number of threads the network runs on, including the calling one. */
+		int thread_count() const {
+			return pool->size();
+		}
+
+		/** Type of the optimizer in use, one of `optimizer::types`. */
+		int optimizer_type() const {
+			return schedule.type();
 		}
 
 		~Network() {
-			delete[] delta_buf;
+			layout::release(predict_buf);
+			layout::release(batch_delta);
+			layout::release(batch_input);
+			layout::release(delta_buf);
 			delete[] results;
 
 			for(int i = 0; i < layer_count; i++) {
 				delete layers[i];
 			}
 			delete[] layers;
+			delete pool;
 		}
 
 		/**
-		 * Writes the network to stream.
-		 * The saved network can be loaded by `Builder::load()`.
+		 * Writes the network to stream, with the weights in scalar type T.
+		 * The header records S, so a mixed precision network is resumed as one.
+		 * The saved network can be loaded by `Builder::load()` of any scalar type.
 		 * @param output Stream to dump this network
 		 */
 		void dump_network(std::ostream& output) {
-			output.write("NeNet", 5);
+			const char scalar_type = ScalarType<S>::id;
+			output.write(CHECKPOINT_MAGIC_V2, 5);
+			output.write(&scalar_type, sizeof(scalar_type));
 			output.write((char*) &layer_count, sizeof(layer_count));
 			for (int i = 0; i < layer_count; i++) {
 				char type = layers[i]->getActivationType();
@@ -321,22 +604,411 @@ namespace nn {
 				output.write((char*) &inputs, sizeof(inputs));
 				output.write((char*) &outputs, sizeof(outputs));
 
-				std::vector<NUM_TYPE> weights = layers[i]->dump_weights();
+				std::vector<T> weights = layers[i]->dump_weights();
 				int size = weights.size();
 				output.write((char*) &size, sizeof(size));
-				output.write((char*) &weights[0], sizeof(NUM_TYPE) * size);
+				output.write((char*) &weights[0], sizeof(T) * size);
+			}
+		}
+
+		/**
+		 * Copies the network with the weights of the moment, e.g. to evaluate them while this one keeps training.
+		 * The copy is passed through a checkpoint, so it starts with the default optimizer.
+		 * @param threads Threads of the copy, see `set_threads()`.
+		 */
+		Network* clone(int threads = 0) {
+			std::stringstream checkpoint(std::ios::in | std::ios::out | std::ios::binary);
+			dump_network(checkpoint);
+			return Builder().load(checkpoint).build(threads);
+		}
+
+		/** Overwrites the weights with the ones of `from`, a `clone()` of this network or the one this was cloned from. Much cheaper than a new `clone()`. */
+		void copy_weights(const Network& from) {
+			assert(from.layer_count == layer_count);
+			for (int i = 0; i < layer_count; i++) {
+				layers[i]->copy_weights(*from.layers[i]);
 			}
 		}
 
 		const int layer_count;
 		const int inputs, outputs;
 	private:
-		Layer** layers;
-		NUM_TYPE** results;
-		NUM_TYPE* delta_buf;
+		/* Padded row lengths of the input and the output, see `Layout.h` */
+		const int input_stride, output_stride;
+
+		static const bool mixed = !std::is_same<T, S>::value;
+
+		Layer<T, S>** layers;
+		/* Worker threads shared by all the layers */
+		ThreadPool* pool;
+		/* Data-parallel shards of a training batch, and the multiply-adds of a sample through all the weights for the cost of a shard */
+		int shards;
+		double weight_count;
+		/* Micro-batches of a training batch through the pipeline */
+		int micro_batches;
+		/* Replicas of the layer buffers, for the shards, the micro-batches or the threads of `train_async()` */
+		int replica_count;
+		/* Taken by the threads of `train_async()` to step the schedule */
+		std::mutex schedule_mutex;
+#ifdef __linux__
+		/* Trainer processes the gradients are summed up over, NULL if alone */
+		ProcessGroup* group;
+#endif
+		/* Learning rate of each step, shared by the optimizers of all the layers */
+		optimizer::Schedule<T> schedule;
+		/* Outputs of each layer, [layer_count + 1] per shard */
+		S** results;
+		T* delta_buf;
+		/* Output of `predict()` widened to T, only when mixed */
+		T* predict_buf;
+
+		/* Gathered minibatch, [batch_capacity x input_stride], and its output delta, [batch_capacity x output_stride]. The padding stays zero. */
+		S* batch_input;
+		T* batch_delta;
+		unsigned int batch_capacity;
+
+		Network(unsigned int layer_count, Layer<T, S>** layers, unsigned int inputs, unsigned int outputs, int threads)
+			: layer_count(layer_count), inputs(inputs), outputs(outputs),
+			input_stride(layout::stride<S>(inputs)), output_stride(layout::stride<S>(outputs)),
+			layers(layers), pool(NULL), shards(1), weight_count(0), micro_batches(1), replica_count(1),
+			schedule(DEFAULT_OPTIMIZER, optimizer::defaults(DEFAULT_OPTIMIZER)),
+			results(new S*[layer_count + 1]), delta_buf(layout::allocate<T>(output_stride)),
+			predict_buf(mixed ? layout::allocate<T>(output_stride) : NULL), batch_input(NULL), batch_delta(NULL), batch_capacity(0) {
+			for (int i = 0; i < this->layer_count; i++) {
+				weight_count += (double) layers[i]->inputs * layers[i]->outputs;
+			}
+#ifdef __linux__
+			group = NULL;
+#endif
+			set_threads(threads);
+		}
+
+		/* A training batch read from the entries of a `DataEntry` array */
+		struct EntryBatch {
+			DataEntry<T>* data;
+			int inputs, outputs;
+
+			EntryBatch(DataEntry<T>* data, int inputs, int outputs) : data(data), inputs(inputs), outputs(outputs) {}
+
+			/* Narrows the inputs of entry `i` into a padded row */
+			void input(int i, S* out) const {
+				assert(data[i].data_count == inputs && data[i].label_count == outputs);
+				kernel::ops<T, S>().narrow(inputs, data[i].data, out);
+			}
+			/* delta = label - output, of entry `i` */
+			void delta(int i, const S* output, T* delta) const {
+				for (int j = 0; j < outputs; j++) {
+					delta[j] = data[i].label[j] - (T) output[j];
+				}
+			}
+		};
+
+		/* A training batch read from the samples of a `SampleSet` from `begin`, scaled and expanded to one-hot as they're read */
+		struct SampleBatch {
+			const SampleSet* samples;
+			size_t begin;
+			int outputs;
+
+			SampleBatch(const SampleSet& samples, size_t begin, int inputs, int outputs) : samples(&samples), begin(begin), outputs(outputs) {
+				assert(samples.inputs() == inputs && samples.classes() == outputs);
+			}
+
+			void input(int i, S* out) const {
+				kernel::ops<T, S>().dequantize(samples->inputs(), samples->data(begin + i), (T) samples->scale(), out);
+			}
+			void delta(int i, const S* output, T* delta) const {
+				const int label = samples->label(begin + i);
+				for (int j = 0; j < outputs; j++) {
+					delta[j] = (j == label ? 1 : 0) - (T) output[j];
+				}
+			}
+		};
+
+		/* A training batch of the rows of a `Minibatch`, gathered and scaled already */
+		struct MinibatchRows {
+			const Minibatch<S>* batch;
+			int outputs;
+
+			MinibatchRows(const Minibatch<S>& batch, int inputs, int outputs) : batch(&batch), outputs(outputs) {
+				assert(batch.inputs == inputs);
+			}
+
+			void input(int i, S* out) const {
+				memcpy(out, batch->row(i), sizeof(S) * batch->stride);
+			}
+			void delta(int i, const S* output, T* delta) const {
+				const int label = batch->labels[i];
+				for (int j = 0; j < outputs; j++) {
+					delta[j] = (j == label ? 1 : 0) - (T) output[j];
+				}
+			}
+		};
+
+		/* Trains on a batch of `EntryBatch`, `SampleBatch` or `MinibatchRows`, see `train()` */
+		template<typename Batch>
+		void train_batch(unsigned int n, const Batch& batch) {
+#ifdef BATCH_TRAIN
+			/* Replicas summing up a part of the gradient each */
+			const int parts = (micro_batches > 1) ? std::min((int) n, micro_batches) : shards;
+			for(int i = 0; i < layer_count; i++) {
+				for (int s = 0; s < parts; s++) {
+					layers[i]->clear_delta(s);
+				}
+			}
+
+			reserve_batch(n);
+
+			if (micro_batches > 1) {
+				train_pipeline(n, parts, batch);
+			} else if (shards > 1) {
+				/* A fixed split of the batch, so the sums don't depend on the threads running the shards. Each shard runs its layers on the thread it got. */
+				pool->parallel_for(shards, (double) n * weight_count * 3, [&](int begin, int end) {
+					for (int s = begin; s < end; s++) {
+						train_shard(s, (int) ((long long) n * s / shards), (int) ((long long) n * (s + 1) / shards), batch);
+					}
+				});
+				for (int l = 0; l < layer_count; l++) {
+					layers[l]->reduce_gradients(shards);
+				}
+			} else {
+				train_shard(0, 0, n, batch);
+			}
+#ifdef __linux__
+			if (group) {
+				for (int l = 0; l < layer_count; l++) {
+					layers[l]->all_reduce_gradients(*group);
+				}
+			}
+#endif
+
+			/* Update weights with their optimizer, once for the whole batch. Each layer splits its rows over the pool by itself. */
+			const kernel::UpdateParams<T> step = schedule.step();
+			for (int l = 0; l < layer_count; l++) {
+				layers[l]->update_weights(step);
+			}
+#else
+			reserve_batch(1);
+			for (unsigned int i = 0; i < n; i++) {
+				/* Retrieve the result(f = output) of the layers */
+				batch.input(i, batch_input);
+				results[0] = batch_input;
+				for (int l = 0; l < layer_count; l++) {
+					results[l + 1] = layers[l]->forward(results[l], true);
+				}
+
+				/* Restore to pre-allocated [outputs] sized array. The pointer is changed during the backpropagation process */
+				T* delta = delta_buf;
+
+				/* Calculate delta for the output layer */
+				batch.delta(i, results[layer_count], delta);
+
+				/* Backpropagate and get a new delta for the next('backward') layer. */
+				for (int l = layer_count - 1; l >= 0; l--) {
+					delta = layers[l]->backward(delta);
+				}
 
-		Network(unsigned int layer_count, Layer** layers, unsigned int inputs, unsigned int outputs)
-			: layers(layers), layer_count(layer_count), inputs(inputs), outputs(outputs), results(new NUM_TYPE*[layer_count + 1]), delta_buf(new NUM_TYPE[outputs]) {}
+				/* Update weights with their optimizer */
+				const kernel::UpdateParams<T> step = schedule.step();
+				for(int l = 0; l < layer_count; l++) {
+					layers[l]->update_weights(results[l], step);
+				}
+			}
+#endif
+		}
+
+#ifdef BATCH_TRAIN
+		/* Trains asynchronously on a batch of `EntryBatch` or `SampleBatch`, see `train_async()` */
+		template<typename Batch>
+		std::vector<int> train_async_batch(unsigned int n, const Batch& batch, unsigned int batch_size) {
+#ifdef LAZY_WEIGHT_DECAY
+			throw std::logic_error("Asynchronous training cannot share the lazy weight decay between the threads");
+#endif
+			const int threads = pool->size();
+			reserve_replicas(threads);
+			reserve_batch(n);
+
+			std::vector<int> updates(threads, 0);
+			std::atomic<unsigned int> next(0);
+			/* Costed to give every thread a task of its own */
+			pool->parallel_for(threads, (double) threads * ThreadPool::MIN_TASK_COST, [&](int begin, int end) {
+				for (int t = begin; t < end; t++) {
+					unsigned int b;
+					while ((b = next.fetch_add(batch_size)) < n) {
+						for (int l = 0; l < layer_count; l++) {
+							layers[l]->clear_delta(t);
+						}
+						train_shard(t, b, std::min(b + batch_size, n), batch);
+
+						std::unique_lock<std::mutex> lock(schedule_mutex);
+						const kernel::UpdateParams<T> step = schedule.step();
+						lock.unlock();
+						for (int l = 0; l < layer_count; l++) {
+							layers[l]->update_weights(step, t);
+						}
+						updates[t]++;
+					}
+				}
+			});
+			return updates;
+		}
+#endif
+
+		/* Forward propagates the input in S. The output is widened into `out`, or returned as is if `out` is NULL. */
+		T* predict(S* data, T* out) {
+			for (int i = 0; i < layer_count; i++) {
+				data = layers[i]->forward(data);
+			}
+			if (!out) return reinterpret_cast<T*>(data);
+
+			kernel::ops<T, S>().widen(outputs, data, out);
+			return out;
+		}
+
+#ifdef BATCH_TRAIN
+		/* Grows the replicas of the layers to at least `count`, with the outputs of each layer per replica */
+		void reserve_replicas(int count) {
+			if (count <= replica_count) return;
+
+			for (int i = 0; i < layer_count; i++) {
+				layers[i]->set_replicas(count);
+			}
+			delete[] results;
+			results = new S*[(layer_count + 1) * count];
+			replica_count = count;
+		}
+
+		/* Propagates the rows [begin, end) of the batch forward and backward on replica `shard` of the layers, summing up their gradients there */
+		template<typename Batch>
+		void train_shard(int shard, int begin, int end, const Batch& data) {
+			const int n = end - begin;
+			S** results = this->results + shard * (layer_count + 1);
+
+			results[0] = gather(begin, end, data);
+			for (int l = 0; l < layer_count; l++) {
+				results[l + 1] = layers[l]->forward_batch(n, results[l], true, shard);
+			}
+
+			T* delta = output_delta(begin, end, data, results[layer_count]);
+			for (int l = layer_count - 1; l >= 0; l--) {
+				delta = layers[l]->backward_batch(n, delta, shard);
+			}
+		}
+
+		/* Runs the pipeline of `set_pipeline()` over the batch of `n` split into `parts` micro-batches, summing up their gradients into replica 0 */
+		template<typename Batch>
+		void train_pipeline(unsigned int n, int parts, const Batch& data) {
+			const std::vector<int> first = stage_layers(pipeline_stages());
+			const int stages = (int) first.size() - 1;
+
+			/* Micro-batches each stage is done with forward and backward, and the delta it passed down for each */
+			std::vector<std::atomic<int>> forwarded(stages), backwarded(stages);
+			for (int s = 0; s < stages; s++) {
+				forwarded[s].store(0);
+				backwarded[s].store(0);
+			}
+			std::vector<T*> stage_delta(parts * stages);
+
+			/* Every stage needs a thread of its own, as the stages wait for each other */
+			pool->run_concurrently(stages, [&](int begin, int end) {
+				for (int s = begin; s < end; s++) {
+					for (int m = 0; m < parts; m++) {
+						const int b = (int) ((long long) n * m / parts), e = (int) ((long long) n * (m + 1) / parts);
+						S** results = this->results + m * (layer_count + 1);
+
+						if (s == 0) results[0] = gather(b, e, data);
+						else wait_for(forwarded[s - 1], m);
+						for (int l = first[s]; l < first[s + 1]; l++) {
+							results[l + 1] = layers[l]->forward_batch(e - b, results[l], true, m);
+						}
+						forwarded[s].store(m + 1, std::memory_order_release);
+					}
+
+					for (int m = 0; m < parts; m++) {
+						const int b = (int) ((long long) n * m / parts), e = (int) ((long long) n * (m + 1) / parts);
+
+						T* delta;
+						if (s == stages - 1) {
+							delta = output_delta(b, e, data, this->results[m * (layer_count + 1) + layer_count]);
+						} else {
+							wait_for(backwarded[s + 1], m);
+							delta = stage_delta[m * stages + s + 1];
+						}
+						for (int l = first[s + 1] - 1; l >= first[s]; l--) {
+							delta = layers[l]->backward_batch(e - b, delta, m);
+						}
+						stage_delta[m * stages + s] = delta;
+						backwarded[s].store(m + 1, std::memory_order_release);
+					}
+
+					/* Reduced on the stage's thread, where the gradients of its layers are */
+					for (int l = first[s]; l < first[s + 1]; l++) {
+						layers[l]->reduce_gradients(parts);
+					}
+				}
+			});
+		}
+
+		/**
+		 * Splits the layers into `stages` contiguous stages of about the same multiply-adds, at least a layer each.
+		 * @returns First layer of each stage, followed by `layer_count`.
+		 */
+		std::vector<int> stage_layers(int stages) const {
+			std::vector<int> first(1, 0);
+			double cost = 0;
+			for (int l = 0; l < layer_count; l++) {
+				cost += (double) layers[l]->inputs * layers[l]->outputs;
+				const int s = (int) first.size();
+				/* Closes the stage once it has its share of the cost, or when the rest of the layers are needed for the rest of the stages */
+				if (s < stages && l + 1 < layer_count && (cost >= weight_count * s / stages || layer_count - (l + 1) == stages - s)) {
+					first.push_back(l + 1);
+				}
+			}
+			first.push_back(layer_count);
+			return first;
+		}
+
+		/* Spins until `counter` passes `m` */
+		static void wait_for(const std::atomic<int>& counter, int m) {
+			while (counter.load(std::memory_order_acquire) <= m) {
+				std::this_thread::yield();
+			}
+		}
+
+		/**
+		 * Gathers the rows [begin, end) of the batch into the row-major [n x input_stride] input matrix.
+		 * @returns The first row gathered.
+		 */
+		template<typename Batch>
+		S* gather(int begin, int end, const Batch& data) {
+			for (int i = begin; i < end; i++) {
+				data.input(i, batch_input + i * input_stride);
+			}
+			return batch_input + begin * input_stride;
+		}
+
+		/**
+		 * Calculates the delta of the output layer for the rows [begin, end) of the batch, from their outputs in row-major [n x output_stride].
+		 * @returns The first row of the delta, in the [n x output_stride] delta matrix.
+		 */
+		template<typename Batch>
+		T* output_delta(int begin, int end, const Batch& data, const S* output) {
+			T* delta = batch_delta + begin * output_stride;
+			for (int i = 0; i < end - begin; i++) {
+				data.delta(begin + i, output + i * output_stride, delta + i * output_stride);
+			}
+			return delta;
+		}
+#endif
+
+		void reserve_batch(unsigned int n) {
+			if (n <= batch_capacity) return;
+
+			layout::release(batch_delta);
+			layout::release(batch_input);
+			batch_input = layout::allocate<S>(n * input_stride);
+			batch_delta = layout::allocate<T>(n * output_stride);
+			batch_capacity = n;
+		}
 	};
 	
 }
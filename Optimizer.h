@@ -0,0 +1,203 @@
+#pragma once
+
+/**
+ * Optimizers updating the weights of the layers, chosen at runtime.
+ * The update of a step is split in two: `Schedule` works out the learning rate(with its decay and Adam's bias correction) once per step for the whole network,
+ * and an `Optimizer` per layer keeps the state arrays and runs the fused kernel of `Kernel.h` over the layer's weights with it, in a single pass.
+ */
+
+#include "Config.h"
+#include "Kernel.h"
+#include "Layout.h"
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+namespace nn {
+	namespace optimizer {
+		namespace types {
+			enum {
+				GD = 0,
+				Momentum,
+				Nesterov,
+				Adagrad,
+				RMSProp,
+				Adam,
+			};
+		}
+
+		/** Name of the optimizer, also accepted on the command line. NULL if `type` is unknown. */
+		inline const char* name(int type) {
+			switch (type) {
+			case types::GD: return "gd";
+			case types::Momentum: return "momentum";
+			case types::Nesterov: return "nesterov";
+			case types::Adagrad: return "adagrad";
+			case types::RMSProp: return "rmsprop";
+			case types::Adam: return "adam";
+			default: return NULL;
+			}
+		}
+
+		/**
+		 * Hyperparameters of an optimizer.
+		 * `beta1` is the momentum factor of Momentum/Nesterov and Adam's first moment decay, `beta2` is RMSProp's rho and Adam's second moment decay.
+		 * `learning_rate_decay` of 1 keeps the learning rate constant.
+		 */
+		struct Hyperparams {
+			double learning_rate;
+			double learning_rate_decay;
+			double weight_decay;
+			double beta1, beta2;
+			double epsilon;
+		};
+
+		/**
+		 * The hyperparameters of Config.h for the optimizer.
+		 * @throws std::invalid_argument if `type` is unknown.
+		 */
+		inline Hyperparams defaults(int type) {
+			Hyperparams h = { 0, 1, 0, 0, 0, 0 };
+			switch (type) {
+			case types::GD:
+				h.learning_rate = GD_LEARNING_RATE;
+				h.learning_rate_decay = GD_LEARNING_RATE_DECAY;
+				h.weight_decay = GD_WEIGHT_DECAY;
+				break;
+			case types::Momentum:
+				h.learning_rate = MOMENTUM_LEARNING_RATE;
+				h.learning_rate_decay = MOMENTUM_LEARNING_RATE_DECAY;
+				h.weight_decay = MOMENTUM_WEIGHT_DECAY;
+				h.beta1 = MOMENTUM_MOMENTUM_FACTOR;
+				break;
+			case types::Nesterov:
+				h.learning_rate = NESTEROV_LEARNING_RATE;
+				h.learning_rate_decay = NESTEROV_LEARNING_RATE_DECAY;
+				h.weight_decay = NESTEROV_WEIGHT_DECAY;
+				h.beta1 = NESTEROV_MOMENTUM_FACTOR;
+				break;
+			case types::Adagrad:
+				h.learning_rate = ADAGRAD_LEARNING_RATE;
+				h.epsilon = ADAGRAD_EPSILON;
+				break;
+			case types::RMSProp:
+				h.learning_rate = RMSPROP_LEARNING_RATE;
+				h.learning_rate_decay = RMSPROP_LEARNING_RATE_DECAY;
+				h.beta2 = RMSPROP_RHO;
+				h.epsilon = RMSPROP_EPSILON;
+				break;
+			case types::Adam:
+				h.learning_rate = ADAM_LEARNING_RATE;
+				h.beta1 = ADAM_BETA1;
+				h.beta2 = ADAM_BETA2;
+				h.epsilon = ADAM_EPSILON;
+				break;
+			default:
+				throw std::invalid_argument("Unknown optimizer type!");
+			}
+#ifdef WEIGHT_DECAY
+			h.weight_decay = WEIGHT_DECAY;
+#endif
+			return h;
+		}
+
+		/**
+		 * Per-step part of the update, shared by all the layers of a network.
+		 */
+		template<typename T>
+		class Schedule {
+		public:
+			Schedule(int type, const Hyperparams& h) : optimizer_type(type), params(h), decay_factor(1), beta1_t(1), beta2_t(1) {}
+
+			int type() const { return optimizer_type; }
+			const Hyperparams& hyperparams() const { return params; }
+
+			/**
+			 * Advances a step.
+			 * @returns The parameters to update every layer with on this step. `scale` is 1.
+			 */
+			kernel::UpdateParams<T> step() {
+				double lr = params.learning_rate * decay_factor;
+				decay_factor *= params.learning_rate_decay;
+				if (optimizer_type == types::Adam) {
+					beta1_t *= params.beta1;
+					beta2_t *= params.beta2;
+					lr = lr * sqrt(1.0 - beta2_t) / (1.0 - beta1_t);
+				}
+				return kernel::update_params<T>(lr, params.weight_decay, params.beta1, params.beta2, params.epsilon);
+			}
+
+		private:
+			int optimizer_type;
+			Hyperparams params;
+			double decay_factor;
+			/* beta^t of Adam, for the bias correction */
+			double beta1_t, beta2_t;
+		};
+
+		/**
+		 * Optimizer of a single layer.
+		 * Keeps the state arrays(velocity, squared gradient sum, or moments) in the same layout as the parameters they belong to,
+		 * so a row of parameters and its states are updated together by a single fused kernel.
+		 */
+		template<typename T>
+		class Optimizer {
+		public:
+			/**
+			 * @param param_count Length of the parameter array to optimize.
+			 * @throws std::invalid_argument if `type` is unknown.
+			 */
+			Optimizer(int type, int param_count) : param_count(param_count), current_type(-1), update_kernel(NULL) {
+				state[0] = state[1] = NULL;
+				reset(type);
+			}
+
+			~Optimizer() {
+				layout::release(state[1]);
+				layout::release(state[0]);
+			}
+
+			/**
+			 * Switches to the optimizer `type`, starting with zeroed states.
+			 * @throws std::invalid_argument if `type` is unknown.
+			 */
+			void reset(int type) {
+				int states;
+				switch (type) {
+				case types::GD: update_kernel = &kernel::Ops<T>::sgd_update; states = 0; break;
+				case types::Momentum: update_kernel = &kernel::Ops<T>::momentum_update; states = 1; break;
+				case types::Nesterov: update_kernel = &kernel::Ops<T>::nesterov_update; states = 1; break;
+				case types::Adagrad: update_kernel = &kernel::Ops<T>::adagrad_update; states = 1; break;
+				case types::RMSProp: update_kernel = &kernel::Ops<T>::rmsprop_update; states = 1; break;
+				case types::Adam: update_kernel = &kernel::Ops<T>::adam_update; states = 2; break;
+				default: throw std::invalid_argument("Unknown optimizer type!");
+				}
+				current_type = type;
+
+				for (int i = 0; i < 2; i++) {
+					layout::release(state[i]);
+					state[i] = (i < states) ? layout::allocate<T>(param_count) : NULL;
+				}
+			}
+
+			int type() const { return current_type; }
+
+			/**
+			 * Updates `n` parameters from `offset` of `params`, with their gradient `g`(multiplied by `p.scale`).
+			 */
+			void update(T* params, int offset, int n, const T* g, const kernel::UpdateParams<T>& p) {
+				(kernel::ops<T>().*update_kernel)(n, params + offset,
+					state[0] ? state[0] + offset : NULL, state[1] ? state[1] + offset : NULL, g, p);
+			}
+
+		private:
+			Optimizer(const Optimizer&);
+			Optimizer& operator=(const Optimizer&);
+
+			const int param_count;
+			int current_type;
+			typename kernel::Ops<T>::UpdateKernel kernel::Ops<T>::* update_kernel;
+			T* state[2];
+		};
+	}
+}
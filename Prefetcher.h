@@ -0,0 +1,222 @@
+#pragma once
+
+/**
+ * A producer thread gathering the next minibatches of a `SampleSet` ahead of the training, while the network trains on the current one.
+ * The batches are passed to the trainer through a ring of `Minibatch` buffers, a single-producer single-consumer queue with no lock,
+ * so the shuffling, the streaming and the scaling of the inputs run off the threads of the network.
+ * With an `Augmenter`, the images of each batch are distorted by a pool of workers of the producer's own.
+ */
+
+#include "Augment.h"
+#include "Dataset.h"
+#include "Kernel.h"
+#include "ThreadPool.h"
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace nn {
+	template<typename T, typename S = T>
+	class Prefetcher {
+	public:
+		/** Counters of the queue since the last `reset_stats()`, to tell whether the trainer waits on the data */
+		struct Stats {
+			/* Batches taken by the trainer */
+			long long batches;
+			/* Batches the trainer had to wait for, and the time it waited */
+			long long stalls;
+			double stall_seconds;
+			/* Batches ready in the queue when the trainer took one, summed up over `batches` */
+			long long depth_sum;
+			/* Samples gathered by the producer, and the seconds it spent on them, not counting the waits for a free buffer */
+			long long produced;
+			double produce_seconds;
+			/* Seconds since the counters started */
+			double seconds;
+
+			double average_depth() const {
+				return batches > 0 ? (double) depth_sum / batches : 0;
+			}
+			/** Samples per second the producer can gather(and distort), and the trainer takes. The first must be well above the second. */
+			double producer_rate() const {
+				return produce_seconds > 0 ? produced / produce_seconds : 0;
+			}
+			double trainer_rate(unsigned int batch_size) const {
+				return seconds > 0 ? batches * (double) batch_size / seconds : 0;
+			}
+		};
+
+		/**
+		 * Starts the producer on the samples, taking `batch_size` of them at a time from the first.
+		 * `samples` belongs to the producer until the prefetcher is destroyed, and is only read by others under `lock_samples()`.
+		 * @param next Called on the producer thread to move on to the next samples when there aren't enough left for a batch, e.g. to shuffle them.
+		 * @param depth Number of batch buffers, at most `depth - 1` gathered ahead of the one being trained on.
+		 * @param reshuffle Draws the next shuffle of the samples a batch at a time as the batches are produced, see `SampleSet::shuffle_ahead()`.
+		 * @param augmenter Distorts the images as they're gathered, or NULL to gather them as they are. Kept by the caller.
+		 * @param workers Threads distorting the images of a batch, including the producer.
+		 */
+		Prefetcher(SampleSet& samples, unsigned int batch_size, int depth, const std::function<void(SampleSet&)>& next, bool reshuffle = false,
+			const Augmenter<T, S>* augmenter = NULL, int workers = 1)
+			: samples(samples), batch_size(batch_size), next(next), reshuffle(reshuffle), augmenter(augmenter), workers(std::max(workers, 1)),
+			head(0), tail(0), stop(false), failed(false), produced(0), produce_nanoseconds(0)
+		{
+			for (int i = 0; i < std::max(depth, 2); i++) {
+				ring.push_back(std::unique_ptr<Minibatch<S>>(new Minibatch<S>(samples.inputs(), batch_size)));
+			}
+			reset_stats();
+			producer = std::thread(&Prefetcher::produce, this);
+		}
+
+		~Prefetcher() {
+			stop.store(true);
+			producer.join();
+		}
+
+		/**
+		 * Takes the next batch, waiting for the producer if it's not ready yet. The batch stays valid until `release()`.
+		 * @throws Whatever the producer threw while moving on to the next samples, e.g. std::runtime_error of a stream.
+		 */
+		const Minibatch<S>& acquire() {
+			const size_t t = tail.load(std::memory_order_relaxed);
+			size_t h = head.load(std::memory_order_acquire);
+			if (h == t) {
+				stats.stalls++;
+				const auto start = std::chrono::steady_clock::now();
+				while ((h = head.load(std::memory_order_acquire)) == t) {
+					if (failed.load(std::memory_order_acquire)) std::rethrow_exception(error);
+					std::this_thread::yield();
+				}
+				stats.stall_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			}
+			stats.batches++;
+			stats.depth_sum += (long long) (h - t);
+			return *ring[t % ring.size()];
+		}
+
+		/** Hands the batch of the last `acquire()` back to the producer. */
+		void release() {
+			tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		Stats get_stats() const {
+			Stats current = stats;
+			current.produced = produced.load() - stats.produced;
+			current.produce_seconds = (produce_nanoseconds.load() - produce_nanoseconds_base) * 1e-9;
+			current.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - stats_start).count();
+			return current;
+		}
+
+		void reset_stats() {
+			stats.batches = stats.stalls = stats.depth_sum = 0;
+			stats.stall_seconds = 0;
+			/* The producer's counters keep running, and the stats count from here */
+			stats.produced = produced.load();
+			produce_nanoseconds_base = produce_nanoseconds.load();
+			stats_start = std::chrono::steady_clock::now();
+		}
+
+		/** Keeps the producer from changing the samples, e.g. to evaluate the network on them, as long as the lock is held. */
+		std::unique_lock<std::mutex> lock_samples() {
+			return std::unique_lock<std::mutex>(samples_mutex);
+		}
+
+	private:
+		static const unsigned long long RANDOM_STREAM = 1ULL << 32;
+
+		SampleSet& samples;
+		const unsigned int batch_size;
+		const std::function<void(SampleSet&)> next;
+		const bool reshuffle;
+		const Augmenter<T, S>* const augmenter;
+		const int workers;
+		std::vector<std::unique_ptr<Minibatch<S>>> ring;
+
+		/* Batches produced and consumed so far, each written by one side only, a cache line apart(padded instead of aligned, as `new` doesn't align the object) */
+		std::atomic<size_t> head;
+		char head_padding[64];
+		std::atomic<size_t> tail;
+
+		std::atomic<bool> stop;
+		std::atomic<bool> failed;
+		std::exception_ptr error;
+		std::mutex samples_mutex;
+		/* Counted by the producer */
+		std::atomic<long long> produced, produce_nanoseconds;
+		/* Only touched by the trainer, with `stats.produced` and `produce_nanoseconds_base` the producer's counters at the last reset */
+		Stats stats;
+		long long produce_nanoseconds_base;
+		std::chrono::steady_clock::time_point stats_start;
+		std::thread producer;
+
+		void produce() {
+			try {
+				/* The producer and its workers take random streams apart from the threads of the network, see `Random::set_stream()` */
+				Random::set_stream(RANDOM_STREAM);
+				/* The workers besides the producer, only started with an augmenter */
+				std::unique_ptr<ThreadPool> pool(augmenter && workers > 1 ? new ThreadPool(workers, std::vector<int>(), RANDOM_STREAM + 1) : NULL);
+				/* Buffers of the distortions, one per part of a batch so the parts running at the same time never share one */
+				std::vector<typename Augmenter<T, S>::Workspace> workspaces;
+				if (augmenter) workspaces.resize(pool ? pool->size() : 1, typename Augmenter<T, S>::Workspace(*augmenter));
+				size_t begin = 0;
+				while (!stop.load(std::memory_order_relaxed)) {
+					const size_t h = head.load(std::memory_order_relaxed);
+					/* Full: the trainer is behind, so there's time to sleep */
+					if (h - tail.load(std::memory_order_acquire) == ring.size()) {
+						std::this_thread::sleep_for(std::chrono::microseconds(50));
+						continue;
+					}
+
+					const auto start = std::chrono::steady_clock::now();
+					if (begin + batch_size > samples.size()) {
+						std::lock_guard<std::mutex> lock(samples_mutex);
+						next(samples);
+						begin = 0;
+						if (batch_size > samples.size()) throw std::runtime_error("The train set is smaller than a batch");
+					}
+
+					Minibatch<S>& batch = *ring[h % ring.size()];
+					const T scale = (T) samples.scale();
+					if (augmenter) {
+						/* The batch is split into parts with a workspace each, and each part is distorted with the generator of the thread running it */
+						const int parts = pool ? pool->plan(batch_size, batch_size * augmenter->cost()) : 1;
+						parallel_for(pool.get(), parts, (double) parts * ThreadPool::MIN_TASK_COST, [&](int first, int last) {
+							Random& random = Random::local();
+							for (int p = first; p < last; p++) {
+								for (unsigned int i = batch_size * p / parts; i < batch_size * (p + 1) / parts; i++) {
+									augmenter->apply(samples.data(begin + i), scale, batch.data + (size_t) i * batch.stride, random, workspaces[p]);
+								}
+							}
+						});
+					} else {
+						for (unsigned int i = 0; i < batch_size; i++) {
+							kernel::ops<T, S>().dequantize(samples.inputs(), samples.data(begin + i), scale, batch.data + (size_t) i * batch.stride);
+						}
+					}
+					for (unsigned int i = 0; i < batch_size; i++) {
+						batch.labels[i] = (unsigned char) samples.label(begin + i);
+					}
+					batch.size = batch_size;
+					begin += batch_size;
+
+					head.store(h + 1, std::memory_order_release);
+					if (reshuffle) samples.shuffle_ahead(batch_size);
+					produced.fetch_add(batch_size, std::memory_order_relaxed);
+					produce_nanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(),
+						std::memory_order_relaxed);
+				}
+			} catch (...) {
+				error = std::current_exception();
+				failed.store(true, std::memory_order_release);
+			}
+		}
+
+		Prefetcher(const Prefetcher&);
+		Prefetcher& operator=(const Prefetcher&);
+	};
+}
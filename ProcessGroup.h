@@ -0,0 +1,225 @@
+#pragma once
+
+/**
+ * Trainer processes on one host, exchanging the gradients through POSIX shared memory.
+ * The processes form a ring, and each one only ever sends to the next and receives from the previous one,
+ * so the same protocol runs over the network by replacing the slots with sockets.
+ * Linux only, as the workers are forked and die with the first process.
+ */
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace nn {
+	class ProcessGroup {
+	public:
+		/* Bytes a process can pass to the next one at a time. Longer messages are sent in pieces. */
+		static const size_t SLOT_SIZE = 256 * 1024;
+
+		/**
+		 * Forks the calling process into `processes` trainers sharing a new segment, before any thread is started.
+		 * The calling process becomes rank 0 and waits for the others on destruction, and the others are killed if it dies.
+		 * @throws std::runtime_error if the segment cannot be created or a process cannot be forked.
+		 * @returns The group of the process, in every process.
+		 */
+		static ProcessGroup* fork(int processes) {
+			char name[64];
+			snprintf(name, sizeof(name), "/mnist_nn.%d", (int) getpid());
+			int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+			if (fd < 0) throw std::runtime_error(std::string("Cannot create the shared memory ") + name);
+
+			const size_t size = sizeof(Channel) * processes + SLOT_SIZE * processes;
+			void* segment = (ftruncate(fd, size) == 0) ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+			close(fd);
+			/* The mapping stays after the name is gone, and nothing is left behind however the processes end */
+			shm_unlink(name);
+			if (segment == MAP_FAILED) throw std::runtime_error(std::string("Cannot map the shared memory ") + name);
+
+			Channel* channels = static_cast<Channel*>(segment);
+			for (int r = 0; r < processes; r++) {
+				new (&channels[r]) Channel();
+			}
+
+			ProcessGroup* group = new ProcessGroup(0, processes, segment, size);
+			for (int r = 1; r < processes; r++) {
+				const pid_t parent = getpid();
+				const pid_t pid = ::fork();
+				if (pid < 0) throw std::runtime_error("Cannot fork a trainer process");
+				if (pid == 0) {
+					prctl(PR_SET_PDEATHSIG, SIGTERM);
+					if (getppid() != parent) _exit(1);
+					group->rank_ = r;
+					group->children.clear();
+					return group;
+				}
+				group->children.push_back(pid);
+			}
+			return group;
+		}
+
+		~ProcessGroup() {
+			for (size_t i = 0; i < children.size(); i++) {
+				waitpid(children[i], NULL, 0);
+			}
+			munmap(segment, segment_size);
+		}
+
+		/** Index of the process in the ring, 0 for the one that forked the others. */
+		int rank() const {
+			return rank_;
+		}
+
+		/** Number of processes in the group. */
+		int size() const {
+			return size_;
+		}
+
+		/**
+		 * Sums `n` elements of `data` over all the processes, with a ring all-reduce, leaving the sum in every process.
+		 * Each of the `size()` chunks is summed by passing it once around the ring, then the sums are passed around once more.
+		 * Every process moves 2 * (size() - 1) / size() of the data, whatever the number of processes.
+		 * The chunks are summed in a fixed order and copied as they are, so every process gets the same bits.
+		 * Every process must call it with the same `n`, in the same order as the other calls of the group.
+		 */
+		template<typename U>
+		void all_reduce(U* data, int n) {
+			if (size_ == 1) return;
+
+			/* Rounds of a chunk per process, each chunk fitting a slot */
+			const int block = (int) (SLOT_SIZE / sizeof(U)) * size_;
+			for (int offset = 0; offset < n; offset += block) {
+				const int m = std::min(block, n - offset);
+				U* d = data + offset;
+
+				/* Reduce-scatter: after size() - 1 steps, this process holds the full sum of chunk rank + 1 */
+				for (int s = 0; s < size_ - 1; s++) {
+					const int out = wrap(rank_ - s), in = wrap(rank_ - s - 1);
+					send(d + chunk(m, out), sizeof(U) * (chunk(m, out + 1) - chunk(m, out)));
+					const U* src = static_cast<const U*>(receive());
+					for (int i = chunk(m, in); i < chunk(m, in + 1); i++) {
+						d[i] += *src++;
+					}
+					consumed();
+				}
+				/* All-gather: pass the sums around the ring */
+				for (int s = 0; s < size_ - 1; s++) {
+					const int out = wrap(rank_ + 1 - s), in = wrap(rank_ - s);
+					send(d + chunk(m, out), sizeof(U) * (chunk(m, out + 1) - chunk(m, out)));
+					memcpy(d + chunk(m, in), receive(), sizeof(U) * (chunk(m, in + 1) - chunk(m, in)));
+					consumed();
+				}
+			}
+		}
+
+		/**
+		 * Copies `bytes` of process `root` to all the others, passed along the ring.
+		 * The other processes are resized to the length of the root's.
+		 */
+		void broadcast(std::string& bytes, int root = 0) {
+			unsigned long long length = bytes.size();
+			broadcast(&length, sizeof(length), root);
+			bytes.resize(length);
+			if (length > 0) broadcast(&bytes[0], length, root);
+		}
+
+		/** Copies `n` bytes of `data` from process `root` to all the others. */
+		void broadcast(void* data, size_t n, int root = 0) {
+			if (size_ == 1) return;
+
+			char* p = static_cast<char*>(data);
+			for (size_t offset = 0; offset < n; offset += SLOT_SIZE) {
+				const size_t m = std::min(SLOT_SIZE, n - offset);
+				if (rank_ != root) {
+					memcpy(p + offset, receive(), m);
+					consumed();
+				}
+				/* The last process of the ring from the root doesn't pass it on */
+				if (wrap(rank_ + 1) != root) send(p + offset, m);
+			}
+		}
+
+	private:
+		/* Sequence numbers of the messages in the slot of a process, each on its own cache line */
+		struct Channel {
+			alignas(64) std::atomic<unsigned long long> posted;
+			alignas(64) std::atomic<unsigned long long> read;
+
+			Channel() : posted(0), read(0) {}
+		};
+
+		int rank_;
+		const int size_;
+		void* const segment;
+		const size_t segment_size;
+		/* Processes forked by rank 0 */
+		std::vector<pid_t> children;
+
+		ProcessGroup(int rank, int size, void* segment, size_t segment_size)
+			: rank_(rank), size_(size), segment(segment), segment_size(segment_size) {}
+
+		ProcessGroup(const ProcessGroup&);
+		ProcessGroup& operator=(const ProcessGroup&);
+
+		int wrap(int r) const {
+			return ((r % size_) + size_) % size_;
+		}
+
+		/* Start of chunk `c` of `n` elements, `size()` chunks of about the same size */
+		int chunk(int n, int c) const {
+			return (int) ((long long) n * c / size_);
+		}
+
+		Channel& channel(int r) {
+			return static_cast<Channel*>(segment)[r];
+		}
+
+		char* slot(int r) {
+			return static_cast<char*>(segment) + sizeof(Channel) * size_ + SLOT_SIZE * r;
+		}
+
+		/* Writes a message into the slot of this process, once the next one has read the last */
+		void send(const void* data, size_t n) {
+			Channel& c = channel(rank_);
+			const unsigned long long posted = c.posted.load(std::memory_order_relaxed);
+			while (c.read.load(std::memory_order_acquire) != posted) {
+				std::this_thread::yield();
+			}
+			memcpy(slot(rank_), data, n);
+			c.posted.store(posted + 1, std::memory_order_release);
+		}
+
+		/* Waits for the next message of the previous process, which stays in its slot until `consumed()` */
+		const void* receive() {
+			const int prev = wrap(rank_ - 1);
+			Channel& c = channel(prev);
+			const unsigned long long read = c.read.load(std::memory_order_relaxed);
+			while (c.posted.load(std::memory_order_acquire) == read) {
+				std::this_thread::yield();
+			}
+			return slot(prev);
+		}
+
+		void consumed() {
+			Channel& c = channel(wrap(rank_ - 1));
+			c.read.fetch_add(1, std::memory_order_release);
+		}
+	};
+}
+
+#endif
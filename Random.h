@@ -0,0 +1,100 @@
+#pragma once
+
+/**
+ * Random numbers for the shuffles, the weight initialization and the dropout, replacing `rand()`.
+ * `rand()` shares a single state between the threads(racing on it, or locking it on some platforms), gives as little as 15 bits on MSVC,
+ * and is biased by `% n`. Every thread has a generator of its own here instead, seeded from a single seed so a run can be repeated.
+ * A thread is told apart from the others by its stream, which the threads of a `ThreadPool` take from their index, so a thread doing the same
+ * share of the work gets the same numbers in every run with the same threads.
+ */
+
+#include <atomic>
+
+namespace nn {
+	/** xoshiro256**, a small and fast generator of 64-bit numbers with a period of 2^256 - 1 */
+	class Random {
+	public:
+		/** Seeds the state from `seed` with splitmix64, as recommended for xoshiro, so close seeds give unrelated sequences. */
+		explicit Random(unsigned long long seed = 0) {
+			for (int i = 0; i < 4; i++) {
+				seed += 0x9e3779b97f4a7c15ULL;
+				unsigned long long z = seed;
+				z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+				z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+				s[i] = z ^ (z >> 31);
+			}
+		}
+
+		unsigned long long next() {
+			const unsigned long long result = rotl(s[1] * 5, 7) * 9;
+			const unsigned long long t = s[1] << 17;
+			s[2] ^= s[0];
+			s[3] ^= s[1];
+			s[1] ^= s[2];
+			s[0] ^= s[3];
+			s[2] ^= t;
+			s[3] = rotl(s[3], 45);
+			return result;
+		}
+
+		/** Uniform in [0, n), without the bias of `% n`. `n` must be positive. */
+		unsigned long long below(unsigned long long n) {
+			/* Rejects the lowest 2^64 % n values, so the rest is a whole number of times n */
+			const unsigned long long threshold = (0 - n) % n;
+			unsigned long long r;
+			do {
+				r = next();
+			} while (r < threshold);
+			return r % n;
+		}
+
+		/** Uniform in [0, 1), from the top 53 bits. */
+		double uniform() {
+			return (next() >> 11) * (1.0 / 9007199254740992.0);
+		}
+
+		/**
+		 * The generator of the calling thread.
+		 * It's seeded on the first call of the thread from the seed of `seed()` and the stream of the thread, see `set_stream()`.
+		 * A thread without a stream takes the next one of its own in the order such threads first call this, which only repeats with a single one, e.g. the main thread.
+		 */
+		static Random& local() {
+			thread_local Random random(base_seed().load() + 0x632be59bd9b4e019ULL * (stream() != UNNAMED ? stream() : UNNAMED + threads().fetch_add(1)));
+			return random;
+		}
+
+		/** Sets the stream of the calling thread, before its first `local()`. The threads of the same stream get the same numbers from the same seed. */
+		static void set_stream(unsigned long long id) {
+			stream() = id;
+		}
+
+		/** Seeds the generators of the threads calling `local()` for the first time after this, e.g. with the time of the run. */
+		static void seed(unsigned long long seed) {
+			base_seed().store(seed);
+			threads().store(0);
+		}
+
+	private:
+		unsigned long long s[4];
+
+		static unsigned long long rotl(unsigned long long x, int k) {
+			return (x << k) | (x >> (64 - k));
+		}
+
+		static std::atomic<unsigned long long>& base_seed() {
+			static std::atomic<unsigned long long> seed(0);
+			return seed;
+		}
+		/* Streams of the threads without one are counted from here, above any set */
+		static const unsigned long long UNNAMED = 1ULL << 63;
+
+		static unsigned long long& stream() {
+			static thread_local unsigned long long id = UNNAMED;
+			return id;
+		}
+		static std::atomic<unsigned long long>& threads() {
+			static std::atomic<unsigned long long> count(0);
+			return count;
+		}
+	};
+}
@@ -0,0 +1,343 @@
+#pragma once
+
+/**
+ * Thin wrappers of the SIMD registers, one namespace per instruction set.
+ * Each `V<T>` exposes the same set of static operations, so a kernel written once against `V<T>` can be compiled for every instruction set.
+ * The instruction sets other than scalar are compiled with per-function target attributes, so the binary runs on any x86 CPU and `Kernel.h` picks one at runtime.
+ * `V<float>` can also load from and store to `bf16`/`fp16` arrays, converting on the fly.
+ */
+
+#include "Config.h"
+#include "Half.h"
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define NN_SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace nn {
+	namespace simd {
+		/** Instruction sets, in the order of preference */
+		namespace isa {
+			enum {
+				Scalar = 0,
+				SSE2,
+				AVX2,
+				AVX512,
+			};
+		}
+
+		/** Portable fallback, one element per "register". */
+		namespace scalar {
+			/* 2^n built from the exponent bits, for an integral n within the normal exponent range */
+			inline double pow2n_bits(double n) {
+				unsigned long long u = (unsigned long long) ((long long) n + 1023) << 52;
+				double r;
+				memcpy(&r, &u, sizeof(r));
+				return r;
+			}
+			inline float pow2n_bits(float n) {
+				unsigned int u = (unsigned int) ((int) n + 127) << 23;
+				float r;
+				memcpy(&r, &u, sizeof(r));
+				return r;
+			}
+
+			template<typename T> struct V {
+				typedef T reg;
+				static const int width = 1;
+
+				static inline reg zero() { return 0; }
+				static inline reg set1(T x) { return x; }
+				template<typename S> static inline reg loadu(const S* p) { return (T) *p; }
+				template<typename S> static inline void storeu(S* p, reg a) { *p = S(a); }
+				static inline reg add(reg a, reg b) { return a + b; }
+				static inline reg sub(reg a, reg b) { return a - b; }
+				static inline reg mul(reg a, reg b) { return a * b; }
+				static inline reg div(reg a, reg b) { return a / b; }
+				static inline reg sqrt(reg a) { return std::sqrt(a); }
+				/* a * b + c */
+				static inline reg fmadd(reg a, reg b, reg c) { return a * b + c; }
+				/* c - a * b */
+				static inline reg fnmadd(reg a, reg b, reg c) { return c - a * b; }
+				/* Named so to stay clear of the min/max macros of <windows.h> */
+				static inline reg minimum(reg a, reg b) { return (a < b) ? a : b; }
+				static inline reg maximum(reg a, reg b) { return (a > b) ? a : b; }
+				static inline reg pow2n(reg n) { return pow2n_bits(n); }
+				static inline T hsum(reg a) { return a; }
+			};
+		}
+	}
+}
+
+#ifdef NN_SIMD_X86
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("sse2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+namespace nn {
+	namespace simd {
+		namespace sse2 {
+			template<typename T> struct V;
+
+			template<> struct V<double> {
+				typedef __m128d reg;
+				static const int width = 2;
+
+				static inline reg zero() { return _mm_setzero_pd(); }
+				static inline reg set1(double x) { return _mm_set1_pd(x); }
+				static inline reg loadu(const double* p) { return _mm_loadu_pd(p); }
+				static inline void storeu(double* p, reg a) { _mm_storeu_pd(p, a); }
+				static inline reg add(reg a, reg b) { return _mm_add_pd(a, b); }
+				static inline reg sub(reg a, reg b) { return _mm_sub_pd(a, b); }
+				static inline reg mul(reg a, reg b) { return _mm_mul_pd(a, b); }
+				static inline reg div(reg a, reg b) { return _mm_div_pd(a, b); }
+				static inline reg sqrt(reg a) { return _mm_sqrt_pd(a); }
+				static inline reg fmadd(reg a, reg b, reg c) { return _mm_add_pd(_mm_mul_pd(a, b), c); }
+				static inline reg fnmadd(reg a, reg b, reg c) { return _mm_sub_pd(c, _mm_mul_pd(a, b)); }
+				static inline reg minimum(reg a, reg b) { return _mm_min_pd(a, b); }
+				static inline reg maximum(reg a, reg b) { return _mm_max_pd(a, b); }
+				/* Adds n to the bias and the magic number 2^52(2^23 for float), which leaves n + bias in the low mantissa bits; shifted into the exponent */
+				static inline reg pow2n(reg n) { return _mm_castsi128_pd(_mm_slli_epi64(_mm_castpd_si128(_mm_add_pd(n, _mm_set1_pd(4503599627370496.0 + 1023))), 52)); }
+				static inline double hsum(reg a) {
+					return _mm_cvtsd_f64(_mm_add_sd(a, _mm_unpackhi_pd(a, a)));
+				}
+			};
+
+			template<> struct V<float> {
+				typedef __m128 reg;
+				static const int width = 4;
+
+				static inline reg zero() { return _mm_setzero_ps(); }
+				static inline reg set1(float x) { return _mm_set1_ps(x); }
+				static inline reg loadu(const float* p) { return _mm_loadu_ps(p); }
+				static inline void storeu(float* p, reg a) { _mm_storeu_ps(p, a); }
+
+				/* bf16 is the upper half of a float */
+				static inline reg loadu(const bf16* p) {
+					__m128i h = _mm_loadl_epi64((const __m128i*) p);
+					return _mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), h));
+				}
+				static inline void storeu(bf16* p, reg a) {
+					__m128i u = _mm_castps_si128(a);
+					__m128i lsb = _mm_and_si128(_mm_srli_epi32(u, 16), _mm_set1_epi32(1));
+					__m128i r = _mm_srli_epi32(_mm_add_epi32(u, _mm_add_epi32(_mm_set1_epi32(0x7fff), lsb)), 16);
+					/* Sign-extend so the signed saturation of packs keeps the bit pattern, as SSE2 has no packus_epi32 */
+					r = _mm_srai_epi32(_mm_slli_epi32(r, 16), 16);
+					_mm_storel_epi64((__m128i*) p, _mm_packs_epi32(r, r));
+				}
+				/* No F16C on this level, converted in software */
+				static inline reg loadu(const fp16* p) {
+					return _mm_setr_ps(p[0], p[1], p[2], p[3]);
+				}
+				static inline void storeu(fp16* p, reg a) {
+					float f[4];
+					_mm_storeu_ps(f, a);
+					for (int i = 0; i < 4; i++) p[i] = fp16(f[i]);
+				}
+				static inline reg add(reg a, reg b) { return _mm_add_ps(a, b); }
+				static inline reg sub(reg a, reg b) { return _mm_sub_ps(a, b); }
+				static inline reg mul(reg a, reg b) { return _mm_mul_ps(a, b); }
+				static inline reg div(reg a, reg b) { return _mm_div_ps(a, b); }
+				static inline reg sqrt(reg a) { return _mm_sqrt_ps(a); }
+				static inline reg fmadd(reg a, reg b, reg c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+				static inline reg fnmadd(reg a, reg b, reg c) { return _mm_sub_ps(c, _mm_mul_ps(a, b)); }
+				static inline reg minimum(reg a, reg b) { return _mm_min_ps(a, b); }
+				static inline reg maximum(reg a, reg b) { return _mm_max_ps(a, b); }
+				static inline reg pow2n(reg n) { return _mm_castsi128_ps(_mm_slli_epi32(_mm_castps_si128(_mm_add_ps(n, _mm_set1_ps(8388608.0f + 127))), 23)); }
+				static inline float hsum(reg a) {
+					__m128 s = _mm_add_ps(a, _mm_movehl_ps(a, a));
+					return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+				}
+			};
+		}
+	}
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2,fma,f16c"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2,fma,f16c")
+#endif
+namespace nn {
+	namespace simd {
+		namespace avx2 {
+			template<typename T> struct V;
+
+			template<> struct V<double> {
+				typedef __m256d reg;
+				static const int width = 4;
+
+				static inline reg zero() { return _mm256_setzero_pd(); }
+				static inline reg set1(double x) { return _mm256_set1_pd(x); }
+				static inline reg loadu(const double* p) { return _mm256_loadu_pd(p); }
+				static inline void storeu(double* p, reg a) { _mm256_storeu_pd(p, a); }
+				static inline reg add(reg a, reg b) { return _mm256_add_pd(a, b); }
+				static inline reg sub(reg a, reg b) { return _mm256_sub_pd(a, b); }
+				static inline reg mul(reg a, reg b) { return _mm256_mul_pd(a, b); }
+				static inline reg div(reg a, reg b) { return _mm256_div_pd(a, b); }
+				static inline reg sqrt(reg a) { return _mm256_sqrt_pd(a); }
+				static inline reg fmadd(reg a, reg b, reg c) { return _mm256_fmadd_pd(a, b, c); }
+				static inline reg fnmadd(reg a, reg b, reg c) { return _mm256_fnmadd_pd(a, b, c); }
+				static inline reg minimum(reg a, reg b) { return _mm256_min_pd(a, b); }
+				static inline reg maximum(reg a, reg b) { return _mm256_max_pd(a, b); }
+				static inline reg pow2n(reg n) { return _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_castpd_si256(_mm256_add_pd(n, _mm256_set1_pd(4503599627370496.0 + 1023))), 52)); }
+				static inline double hsum(reg a) {
+					__m128d s = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+					return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+				}
+			};
+
+			template<> struct V<float> {
+				typedef __m256 reg;
+				static const int width = 8;
+
+				static inline reg zero() { return _mm256_setzero_ps(); }
+				static inline reg set1(float x) { return _mm256_set1_ps(x); }
+				static inline reg loadu(const float* p) { return _mm256_loadu_ps(p); }
+				static inline void storeu(float* p, reg a) { _mm256_storeu_ps(p, a); }
+
+				static inline reg loadu(const bf16* p) {
+					__m256i u = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) p));
+					return _mm256_castsi256_ps(_mm256_slli_epi32(u, 16));
+				}
+				static inline void storeu(bf16* p, reg a) {
+					__m256i u = _mm256_castps_si256(a);
+					__m256i lsb = _mm256_and_si256(_mm256_srli_epi32(u, 16), _mm256_set1_epi32(1));
+					__m256i r = _mm256_srli_epi32(_mm256_add_epi32(u, _mm256_add_epi32(_mm256_set1_epi32(0x7fff), lsb)), 16);
+					/* packus works per 128-bit lane, so gather the two low quadwords afterwards */
+					r = _mm256_permute4x64_epi64(_mm256_packus_epi32(r, r), 0x08);
+					_mm_storeu_si128((__m128i*) p, _mm256_castsi256_si128(r));
+				}
+				static inline reg loadu(const fp16* p) {
+					return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*) p));
+				}
+				static inline void storeu(fp16* p, reg a) {
+					_mm_storeu_si128((__m128i*) p, _mm256_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT));
+				}
+				static inline reg add(reg a, reg b) { return _mm256_add_ps(a, b); }
+				static inline reg sub(reg a, reg b) { return _mm256_sub_ps(a, b); }
+				static inline reg mul(reg a, reg b) { return _mm256_mul_ps(a, b); }
+				static inline reg div(reg a, reg b) { return _mm256_div_ps(a, b); }
+				static inline reg sqrt(reg a) { return _mm256_sqrt_ps(a); }
+				static inline reg fmadd(reg a, reg b, reg c) { return _mm256_fmadd_ps(a, b, c); }
+				static inline reg fnmadd(reg a, reg b, reg c) { return _mm256_fnmadd_ps(a, b, c); }
+				static inline reg minimum(reg a, reg b) { return _mm256_min_ps(a, b); }
+				static inline reg maximum(reg a, reg b) { return _mm256_max_ps(a, b); }
+				static inline reg pow2n(reg n) { return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_castps_si256(_mm256_add_ps(n, _mm256_set1_ps(8388608.0f + 127))), 23)); }
+				static inline float hsum(reg a) {
+					__m128 s = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+					s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+					return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+				}
+			};
+		}
+	}
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f,avx2,fma,f16c"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma,f16c")
+#endif
+namespace nn {
+	namespace simd {
+		namespace avx512 {
+			template<typename T> struct V;
+
+			template<> struct V<double> {
+				typedef __m512d reg;
+				static const int width = 8;
+
+				static inline reg zero() { return _mm512_setzero_pd(); }
+				static inline reg set1(double x) { return _mm512_set1_pd(x); }
+				static inline reg loadu(const double* p) { return _mm512_loadu_pd(p); }
+				static inline void storeu(double* p, reg a) { _mm512_storeu_pd(p, a); }
+				static inline reg add(reg a, reg b) { return _mm512_add_pd(a, b); }
+				static inline reg sub(reg a, reg b) { return _mm512_sub_pd(a, b); }
+				static inline reg mul(reg a, reg b) { return _mm512_mul_pd(a, b); }
+				static inline reg div(reg a, reg b) { return _mm512_div_pd(a, b); }
+				static inline reg sqrt(reg a) { return _mm512_sqrt_pd(a); }
+				static inline reg fmadd(reg a, reg b, reg c) { return _mm512_fmadd_pd(a, b, c); }
+				static inline reg fnmadd(reg a, reg b, reg c) { return _mm512_fnmadd_pd(a, b, c); }
+				static inline reg minimum(reg a, reg b) { return _mm512_min_pd(a, b); }
+				static inline reg maximum(reg a, reg b) { return _mm512_max_pd(a, b); }
+				static inline reg pow2n(reg n) { return _mm512_castsi512_pd(_mm512_slli_epi64(_mm512_castpd_si512(_mm512_add_pd(n, _mm512_set1_pd(4503599627370496.0 + 1023))), 52)); }
+				static inline double hsum(reg a) {
+					__m256d h = _mm256_add_pd(_mm512_extractf64x4_pd(a, 0), _mm512_extractf64x4_pd(a, 1));
+					__m128d s = _mm_add_pd(_mm256_castpd256_pd128(h), _mm256_extractf128_pd(h, 1));
+					return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+				}
+			};
+
+			template<> struct V<float> {
+				typedef __m512 reg;
+				static const int width = 16;
+
+				static inline reg zero() { return _mm512_setzero_ps(); }
+				static inline reg set1(float x) { return _mm512_set1_ps(x); }
+				static inline reg loadu(const float* p) { return _mm512_loadu_ps(p); }
+				static inline void storeu(float* p, reg a) { _mm512_storeu_ps(p, a); }
+
+				static inline reg loadu(const bf16* p) {
+					__m512i u = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*) p));
+					return _mm512_castsi512_ps(_mm512_slli_epi32(u, 16));
+				}
+				static inline void storeu(bf16* p, reg a) {
+					__m512i u = _mm512_castps_si512(a);
+					__m512i lsb = _mm512_and_si512(_mm512_srli_epi32(u, 16), _mm512_set1_epi32(1));
+					__m512i r = _mm512_srli_epi32(_mm512_add_epi32(u, _mm512_add_epi32(_mm512_set1_epi32(0x7fff), lsb)), 16);
+					_mm256_storeu_si256((__m256i*) p, _mm512_cvtepi32_epi16(r));
+				}
+				static inline reg loadu(const fp16* p) {
+					return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*) p));
+				}
+				static inline void storeu(fp16* p, reg a) {
+					_mm256_storeu_si256((__m256i*) p, _mm512_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT));
+				}
+				static inline reg add(reg a, reg b) { return _mm512_add_ps(a, b); }
+				static inline reg sub(reg a, reg b) { return _mm512_sub_ps(a, b); }
+				static inline reg mul(reg a, reg b) { return _mm512_mul_ps(a, b); }
+				static inline reg div(reg a, reg b) { return _mm512_div_ps(a, b); }
+				static inline reg sqrt(reg a) { return _mm512_sqrt_ps(a); }
+				static inline reg fmadd(reg a, reg b, reg c) { return _mm512_fmadd_ps(a, b, c); }
+				static inline reg fnmadd(reg a, reg b, reg c) { return _mm512_fnmadd_ps(a, b, c); }
+				static inline reg minimum(reg a, reg b) { return _mm512_min_ps(a, b); }
+				static inline reg maximum(reg a, reg b) { return _mm512_max_ps(a, b); }
+				static inline reg pow2n(reg n) { return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_castps_si512(_mm512_add_ps(n, _mm512_set1_ps(8388608.0f + 127))), 23)); }
+				static inline float hsum(reg a) {
+					/* Fold the upper 256 bits onto the lower, without requiring AVX512DQ */
+					__m512 h = _mm512_add_ps(a, _mm512_shuffle_f32x4(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+					__m256 h8 = _mm512_castps512_ps256(h);
+					__m128 s = _mm_add_ps(_mm256_castps256_ps128(h8), _mm256_extractf128_ps(h8, 1));
+					s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+					return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+				}
+			};
+		}
+	}
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#endif /* NN_SIMD_X86 */
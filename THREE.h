@@ -1,9 +1,11 @@
 #pragma once
 
 #include "Dataset.h"
+#include "TextLoader.h"
 
 namespace nn {
-	class THREE : public Dataset {
+	template<typename T = NUM_TYPE>
+	class THREE : public Dataset<T> {
 	public:
 		static const int INPUTS = 64, OUTPUTS = 3;
 
@@ -11,48 +13,29 @@ namespace nn {
 			: train(train_file), test(test_file)
 		{}
 
-		std::vector<DataEntry> get_train_set() {
-			int label;
-			FILE* three_train = fopen(train, "r");
-			std::vector<DataEntry> dataset;
-			while (fscanf(three_train, "%d $", &label) > 0) {
-				DataEntry entry(INPUTS, OUTPUTS);
-
-				for (int i = 0; i < OUTPUTS; i++) {
-					entry.label[i] = (label == i) ? 1 : 0;
-				}
-
-				for (int i = 0; i < INPUTS; i++) {
-					fscanf(three_train, "%lf", &entry.data[i]);
-				}
-				fscanf(three_train, "%*d");
-
-				dataset.push_back(std::move(entry));
-			}
-			return dataset;
+		std::vector<DataEntry<T>> get_train_set() override {
+			return to_entries<T>(get_train_samples());
 		}
 
-		std::vector<DataEntry> get_test_set() {
-			int label;
-			FILE* three_test = fopen(test, "r");
-			std::vector<DataEntry> dataset;
-			while (fscanf(three_test, "%d $", &label) > 0) {
-				DataEntry entry(INPUTS, OUTPUTS);
-
-				for (int i = 0; i < OUTPUTS; i++) {
-					entry.label[i] = (label == i) ? 1 : 0;
-				}
-
-				for (int i = 0; i < INPUTS; i++) {
-					fscanf(three_test, "%lf", &entry.data[i]);
-				}
-				fscanf(three_test, "%*d");
-
-				dataset.push_back(std::move(entry));
-			}
-			return dataset;
+		std::vector<DataEntry<T>> get_test_set() override {
+			return to_entries<T>(get_test_samples());
+		}
+
+		/** The inputs are stored as bytes unscaled, so they must be integers in 0~255 such as the 0~16 pixel counts of the 8x8 digits. */
+		SampleSet get_train_samples() override {
+			return load_text(train, FORMAT);
+		}
+
+		SampleSet get_test_samples() override {
+			return load_text(test, FORMAT);
 		}
 	private:
+		/* A label, `$`, the 64 inputs and a number left unused, separated by whitespace. */
+		static const TextFormat FORMAT;
+
 		const char *train, *test;
 	};
-}
\ No newline at end of file
+
+	template<typename T>
+	const TextFormat THREE<T>::FORMAT = { THREE<T>::INPUTS, THREE<T>::OUTPUTS, 1, 66, 1, "$" };
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+/**
+ * Parser of the text datasets, records of numbers separated by whitespace, e.g. a label followed by the pixels of an image.
+ * The file is mapped and cut into chunks at the separators, and the chunks are parsed on all the hardware threads at once straight into the arena of a `SampleSet`.
+ * A record may span chunks, so the numbers of each chunk are counted in a first parallel pass, which tells every chunk the record and field of its first number.
+ */
+
+#include "Dataset.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace nn {
+	/** Layout of the records of a text dataset */
+	struct TextFormat {
+		int inputs, classes;
+		/* Multiplied to the stored bytes to get the inputs, see `SampleSet` */
+		double scale;
+		/* Numbers per record. The first one is the label, and the inputs follow from `first_input`. The others are skipped. */
+		int fields;
+		int first_input;
+		/* Characters separating the numbers besides whitespace, e.g. "$" */
+		const char* separators;
+	};
+
+	namespace text {
+		/* Bytes parsed per chunk at least, so a small file isn't split for nothing */
+		static const size_t MIN_CHUNK = 256 * 1024;
+
+		/**
+		 * Parses a decimal number [+-]digits[.digits][e[+-]digits] from [p, end), in place of `strtod()`,
+		 * which needs a terminated string and checks the locale.
+		 * @returns false if the text is not a whole number.
+		 */
+		inline bool parse_number(const char* p, const char* end, double& value) {
+			bool negative = false;
+			if (p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+
+			const char* digits = p;
+			double v = 0;
+			while (p < end && (unsigned) (*p - '0') < 10) v = v * 10 + (*p++ - '0');
+			if (p < end && *p == '.') {
+				p++;
+				double place = 0.1;
+				while (p < end && (unsigned) (*p - '0') < 10) {
+					v += (*p++ - '0') * place;
+					place *= 0.1;
+				}
+			}
+			if (p == digits || (p == digits + 1 && *digits == '.')) return false;
+
+			if (p < end && (*p == 'e' || *p == 'E')) {
+				p++;
+				bool negative_exponent = false;
+				if (p < end && (*p == '-' || *p == '+')) negative_exponent = (*p++ == '-');
+				if (p == end) return false;
+				int exponent = 0;
+				while (p < end && (unsigned) (*p - '0') < 10) exponent = std::min(exponent * 10 + (*p++ - '0'), 400);
+				for (int i = 0; i < exponent; i++) v = negative_exponent ? v / 10 : v * 10;
+			}
+			value = negative ? -v : v;
+			return p == end;
+		}
+	}
+
+	/**
+	 * Loads a text dataset into a set of its own.
+	 * The inputs are stored as bytes, so they must be integers in 0~255. They're multiplied by `TextFormat::scale` as they're read.
+	 * @throws std::runtime_error if the file cannot be mapped, ends in the middle of a record, or holds something else than a number, an invalid label or an input out of the bytes.
+	 */
+	inline SampleSet load_text(const char* path, const TextFormat& format) {
+		std::shared_ptr<MappedFile> file = MappedFile::open(path);
+		const char* text = reinterpret_cast<const char*>(file->data());
+		const size_t size = file->size();
+		file->advise(0, size, MappedFile::Sequential);
+
+		bool separator[256] = {};
+		separator[(unsigned char) ' '] = separator[(unsigned char) '\t'] = separator[(unsigned char) '\n'] = true;
+		separator[(unsigned char) '\r'] = separator[(unsigned char) '\v'] = separator[(unsigned char) '\f'] = true;
+		for (const char* c = format.separators; c && *c; c++) separator[(unsigned char) *c] = true;
+
+		ThreadPool pool;
+		const int chunks = (int) std::max((size_t) 1, std::min((size_t) pool.size() * 4, size / text::MIN_CHUNK));
+		/* Costed to give every chunk a task of its own */
+		const double cost = (double) chunks * ThreadPool::MIN_TASK_COST;
+
+		/* Chunk boundaries, moved forward to a separator so no number is cut */
+		std::vector<size_t> bounds(chunks + 1, size);
+		bounds[0] = 0;
+		for (int c = 1; c < chunks; c++) {
+			size_t b = std::max(size * c / chunks, bounds[c - 1]);
+			while (b < size && !separator[(unsigned char) text[b]]) b++;
+			bounds[c] = b;
+		}
+
+		/* Numbers before each chunk, counted per chunk first */
+		std::vector<size_t> first(chunks + 1, 0);
+		pool.parallel_for(chunks, cost, [&](int begin, int end) {
+			for (int c = begin; c < end; c++) {
+				size_t numbers = 0;
+				bool in_number = false;
+				for (size_t i = bounds[c]; i < bounds[c + 1]; i++) {
+					const bool is_separator = separator[(unsigned char) text[i]];
+					if (!is_separator && !in_number) numbers++;
+					in_number = !is_separator;
+				}
+				first[c + 1] = numbers;
+			}
+		});
+		for (int c = 0; c < chunks; c++) first[c + 1] += first[c];
+		if (first[chunks] % format.fields != 0) throw std::runtime_error(std::string(path) + " ends in the middle of a sample");
+
+		SampleSet samples(format.inputs, format.classes, format.scale);
+		samples.resize(first[chunks] / format.fields);
+		std::atomic<bool> invalid(false);
+		pool.parallel_for(chunks, cost, [&](int begin, int end) {
+			for (int c = begin; c < end; c++) {
+				size_t sample = first[c] / format.fields;
+				int field = (int) (first[c] % format.fields);
+				size_t i = bounds[c];
+				while (true) {
+					while (i < bounds[c + 1] && separator[(unsigned char) text[i]]) i++;
+					if (i == bounds[c + 1]) break;
+					const size_t start = i;
+					while (i < bounds[c + 1] && !separator[(unsigned char) text[i]]) i++;
+
+					double value;
+					if (!text::parse_number(text + start, text + i, value)) {
+						invalid.store(true);
+						return;
+					}
+					if (field == 0) {
+						if (value < 0 || value >= format.classes || value != std::floor(value)) {
+							invalid.store(true);
+							return;
+						}
+						samples.set_label(sample, (int) value);
+					} else if (field >= format.first_input && field < format.first_input + format.inputs) {
+						/* Anything else than a byte would be stored as another value */
+						if (value < 0 || value > 255 || value != std::floor(value)) {
+							invalid.store(true);
+							return;
+						}
+						samples.row(sample)[field - format.first_input] = (unsigned char) value;
+					}
+
+					if (++field == format.fields) {
+						field = 0;
+						sample++;
+					}
+				}
+			}
+		});
+		if (invalid.load()) throw std::runtime_error(std::string(path) + " has an invalid number, label or input");
+		return samples;
+	}
+}
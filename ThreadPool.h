@@ -0,0 +1,244 @@
+#pragma once
+
+/**
+ * Persistent worker threads for the layers and kernels, replacing the OpenMP parallel regions.
+ * The workers stay alive for the whole training, spinning for a while after each job so the next one starts without a wake-up.
+ * A job only wakes as many workers as its estimated cost is worth, so the small layers run on the calling thread alone.
+ */
+
+#include "Random.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace nn {
+	class ThreadPool {
+	public:
+		/**
+		 * Cost(in multiply-adds) a thread should have to be worth waking, a few microseconds of work.
+		 * Below this, the wake-up and the join take longer than the work they split.
+		 */
+		static const int MIN_TASK_COST = 32768;
+
+		/**
+		 * Starts the workers. The calling thread takes part in every job as the first thread.
+		 * @param threads Total number of threads including the calling one, or 0 for one per hardware thread.
+		 * @param cpus CPUs to pin the threads to, the calling thread on `cpus[0]` and worker i on `cpus[i % size]`. Empty leaves them to the OS.
+		 * @param stream Random stream of the first worker, see `Random::set_stream()`. Worker i takes `stream + i - 1`.
+		 */
+		explicit ThreadPool(int threads = 0, const std::vector<int>& cpus = std::vector<int>(), unsigned long long stream = 1) : cpus(cpus), stream(stream) {
+			if (threads <= 0) threads = std::max(1, (int) std::thread::hardware_concurrency());
+			if (!cpus.empty()) pin(cpus[0]);
+
+			workers.reserve(threads - 1);
+			for (int i = 1; i < threads; i++) {
+				workers.push_back(new Worker);
+			}
+			for (int i = 1; i < threads; i++) {
+				workers[i - 1]->thread = std::thread(&ThreadPool::worker_loop, this, i);
+			}
+		}
+
+		~ThreadPool() {
+			for (size_t i = 0; i < workers.size(); i++) {
+				Worker* w = workers[i];
+				{
+					std::lock_guard<std::mutex> lock(w->mutex);
+					w->stop = true;
+				}
+				w->cv.notify_one();
+				w->thread.join();
+				delete w;
+			}
+		}
+
+		/** Number of threads, including the calling one. */
+		int size() const {
+			return (int) workers.size() + 1;
+		}
+
+		/**
+		 * Number of threads a job of `n` items costing `cost` in total is split into.
+		 * Every thread gets at least `MIN_TASK_COST` of the work and one item.
+		 */
+		int plan(int n, double cost) const {
+			const double by_cost = cost / MIN_TASK_COST;
+			int tasks = by_cost < size() ? (int) by_cost : size();
+			if (tasks > n) tasks = n;
+			return tasks > 1 ? tasks : 1;
+		}
+
+		/**
+		 * Runs `fn(begin, end)` over [0, n), split into contiguous chunks of about the same size, one per thread.
+		 * Returns after all the chunks are done. Called from inside a job, the whole range runs on the calling thread.
+		 * @param cost Estimated cost of the whole range in multiply-adds, see `plan()`.
+		 */
+		template<typename F>
+		void parallel_for(int n, double cost, const F& fn) {
+			const int tasks = in_job() ? 1 : plan(n, cost);
+			if (tasks <= 1) {
+				if (n > 0) fn(0, n);
+				return;
+			}
+			dispatch(n, tasks, fn);
+		}
+
+		/**
+		 * Runs `fn(t, t + 1)` for every t in [0, tasks), each on a thread of its own at the same time, for tasks which wait for each other.
+		 * Returns after all the tasks are done.
+		 * @throws std::logic_error if there are more tasks than threads, or if called from inside a job, where the tasks would run one after another and wait forever.
+		 */
+		template<typename F>
+		void run_concurrently(int tasks, const F& fn) {
+			if (tasks > size()) throw std::logic_error("More concurrent tasks than threads");
+			if (tasks > 1 && in_job()) throw std::logic_error("Concurrent tasks cannot run from inside a job");
+			if (tasks == 1) {
+				fn(0, 1);
+			} else if (tasks > 1) {
+				dispatch(tasks, tasks, fn);
+			}
+		}
+
+	private:
+		/* Runs `fn` over [0, n) split into `tasks` chunks, the first on the calling thread and the rest on the first workers */
+		template<typename F>
+		void dispatch(int n, int tasks, const F& fn) {
+			pending.store(tasks - 1);
+			for (int t = 1; t < tasks; t++) {
+				Worker* w = workers[t - 1];
+				w->job = &invoke<F>;
+				w->context = &fn;
+				w->begin = chunk(n, tasks, t);
+				w->end = chunk(n, tasks, t + 1);
+				w->sequence.fetch_add(1);
+				if (w->sleeping.load()) {
+					{ std::lock_guard<std::mutex> lock(w->mutex); }
+					w->cv.notify_one();
+				}
+			}
+
+			in_job() = true;
+			fn(0, chunk(n, tasks, 1));
+			in_job() = false;
+
+			while (pending.load(std::memory_order_acquire) > 0) {
+				std::this_thread::yield();
+			}
+		}
+
+		typedef void (*Job)(const void* context, int begin, int end);
+
+		/* Mailbox of a worker, written by the calling thread only while the worker is idle */
+		struct Worker {
+			std::thread thread;
+			std::mutex mutex;
+			std::condition_variable cv;
+			std::atomic<unsigned> sequence;
+			std::atomic<bool> sleeping;
+			bool stop;
+
+			Job job;
+			const void* context;
+			int begin, end;
+
+			Worker() : sequence(0), sleeping(false), stop(false), job(NULL), context(NULL), begin(0), end(0) {}
+		};
+
+		/* Number of `yield()`s a worker spins for a new job before going to sleep */
+		static const int SPIN_COUNT = 2000;
+
+		std::vector<Worker*> workers;
+		std::vector<int> cpus;
+		const unsigned long long stream;
+		std::atomic<int> pending;
+
+		ThreadPool(const ThreadPool&);
+		ThreadPool& operator=(const ThreadPool&);
+
+		template<typename F>
+		static void invoke(const void* context, int begin, int end) {
+			(*static_cast<const F*>(context))(begin, end);
+		}
+
+		static int chunk(int n, int tasks, int t) {
+			return (int) ((long long) n * t / tasks);
+		}
+
+		/* Whether the current thread is running a chunk, to keep the nested jobs on it */
+		static bool& in_job() {
+			static thread_local bool flag = false;
+			return flag;
+		}
+
+		void worker_loop(int index) {
+			Worker* w = workers[index - 1];
+			if (!cpus.empty()) pin(cpus[index % cpus.size()]);
+			/* Chunk i of every job runs on worker i, so the worker's numbers are the same in every run */
+			Random::set_stream(stream + index - 1);
+			in_job() = true;
+
+			unsigned seen = 0;
+			while (true) {
+				for (int spin = 0; spin < SPIN_COUNT && w->sequence.load(std::memory_order_acquire) == seen; spin++) {
+					std::this_thread::yield();
+				}
+				if (w->sequence.load(std::memory_order_acquire) == seen) {
+					std::unique_lock<std::mutex> lock(w->mutex);
+					w->sleeping.store(true);
+					while (w->sequence.load() == seen && !w->stop) {
+						w->cv.wait(lock);
+					}
+					w->sleeping.store(false);
+					if (w->stop) return;
+				}
+				seen = w->sequence.load(std::memory_order_acquire);
+
+				w->job(w->context, w->begin, w->end);
+				pending.fetch_sub(1, std::memory_order_release);
+			}
+		}
+
+		/* Pins the calling thread to `cpu`, where supported */
+		static void pin(int cpu) {
+#ifdef _WIN32
+			SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << cpu);
+#elif defined(__linux__)
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+			(void) cpu;
+#endif
+		}
+	};
+
+	/**
+	 * `pool->parallel_for()`, or the whole range on the calling thread if `pool` is NULL.
+	 */
+	template<typename F>
+	inline void parallel_for(ThreadPool* pool, int n, double cost, const F& fn) {
+		if (pool) {
+			pool->parallel_for(n, cost, fn);
+		} else if (n > 0) {
+			fn(0, n);
+		}
+	}
+}
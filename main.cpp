@@ -2,13 +2,21 @@
 //#include "THREE.h"
 //#include "MNIST.h"
 #include "MNIST_bin.h"
+#include "MNIST_idx.h"
+#include "MNIST_shards.h"
+#include "Prefetcher.h"
+#include "Evaluator.h"
+#include <cmath>
 #include <vector>
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <memory>
 #include <cstdlib>
 #include <ctime>
 #include <algorithm>
+#include <chrono>
+#include <sstream>
 #include <string>
 
 bool hasOption(char** begin, char** end, const std::string& option) {
@@ -24,23 +32,113 @@ char* getOptionValue(char** begin, char** end, const std::string& option) {
 	}
 }
 
-int main(int argc, char* argv[]) {
-	if (hasOption(argv, argv + argc, "-h")) {
-		std::cout	<< "========================================= Neural Network Trainer - Usage =========================================" << std::endl
-					<< " Train Mode: MNIST_NN [-h1 {Neurons in 1st hidden layer}] [-h2 {Neurons in 2nd hidden layer}] [-t {MSE threshold}]" << std::endl
-					<< "  or to start from a checkpoint: MNIST_NN -c {Checkpoint file} -e {Epoch count} [-t {MSE threshold}]" << std::endl
-					<< "  > The program reads two files, train.bin and test.bin, and starts training until MSE reaches the threshold" << std::endl
-					<< "  > threshold defaults to " STR(DEFAULT_MSE_THRESHOLD) ", "
-							"h1 defaults to " STR(DEFAULT_HIDDEN_LAYER_1) ", "
-							"h2 defaults to " STR(DEFAULT_HIDDEN_LAYER_2) << std::endl
-					<< " Run Mode: MNIST_NN -r -c {Checkpoint file}" << std::endl
-					<< "  > Input 784 integers in range 0~255 through standard input to get the predicted number. Program ends on EOF." << std::endl
-					<< "==================================================================================================================" << std::endl;
-		return 0;
+/**
+ * Applies the thread options to the network: -j {threads} and -a [{cpu,cpu,...}].
+ * -a alone pins the threads to the CPUs from 0 in order.
+ * Without -j, trainer process `rank` of `processes` takes its share of the hardware threads, and -a alone pins it to the CPUs after the ones of the previous processes.
+ * @returns false if an option is invalid, after printing why.
+ */
+template<typename T, typename S>
+bool setThreads(nn::Network<T, S>* network, int argc, char* argv[], int rank = 0, int processes = 1) {
+	int threads = 0;
+	char* threads_s = getOptionValue(argv, argv + argc, "-j");
+	if (threads_s) {
+		threads = strtol(threads_s, NULL, 10);
+		if (threads <= 0) {
+			std::cout << "Invalid thread count: " << threads_s << std::endl;
+			return false;
+		}
+	} else if (processes > 1) {
+		threads = std::max(1, network->thread_count() / processes);
 	}
 
-	char* checkpoint = getOptionValue(argv, argv + argc, "-c");
+	std::vector<int> cpus;
+	if (hasOption(argv, argv + argc, "-a")) {
+		char* cpus_s = getOptionValue(argv, argv + argc, "-a");
+		if (cpus_s) {
+			char* p = cpus_s;
+			while (*p) {
+				char* end;
+				long cpu = strtol(p, &end, 10);
+				if (end == p || cpu < 0 || (*end && *end != ',')) {
+					std::cout << "Invalid CPU list: " << cpus_s << std::endl;
+					return false;
+				}
+				cpus.push_back((int) cpu);
+				p = *end ? end + 1 : end;
+			}
+		} else {
+			const int count = threads > 0 ? threads : network->thread_count();
+			for (int i = 0; i < count; i++) cpus.push_back(rank * count + i);
+		}
+	}
+
+	if (threads_s || !cpus.empty() || processes > 1) network->set_threads(threads, cpus);
+	return true;
+}
+
+/**
+ * Moves on to the next samples to train with from the first of `samples`: shuffles them, or reads the next STREAM_BUFFER of the stream into them.
+ * The last samples of a pass that don't fill a batch are dropped, and the next pass is started.
+ * @throws std::runtime_error if the stream doesn't have a batch at all.
+ */
+void nextSamples(nn::SampleSet& samples, nn::SampleStream* stream, size_t batch_size) {
+	if (!stream) {
+#ifdef BATCH_TRAIN
+		// A batch of the whole set sums up the same gradient in any order
+		if (batch_size >= samples.size()) return;
+#endif
+		samples.shuffle();
+	} else if (stream->next(samples, STREAM_BUFFER) < batch_size) {
+		stream->rewind();
+		if (stream->next(samples, STREAM_BUFFER) < batch_size) throw std::runtime_error("The train stream is shorter than a batch");
+	}
+}
+
+/**
+ * Prints the confusion matrix of the evaluation, the samples of each label(row) predicted as each class(column),
+ * and the precision and the recall of each class.
+ */
+void printConfusion(const nn::Evaluation& evaluation) {
+	std::cout << std::endl << "Confusion matrix(label x predicted):" << std::endl << "     ";
+	for (int p = 0; p < evaluation.classes; p++) std::cout << std::setw(7) << p;
+	std::cout << std::setw(11) << "Precision" << std::setw(9) << "Recall" << std::endl;
+	for (int l = 0; l < evaluation.classes; l++) {
+		std::cout << std::setw(5) << l;
+		for (int p = 0; p < evaluation.classes; p++) std::cout << std::setw(7) << evaluation.at(l, p);
+		std::cout << std::fixed << std::setprecision(4)
+			<< std::setw(11) << evaluation.precision(l) << std::setw(9) << evaluation.recall(l) << std::defaultfloat << std::endl;
+	}
+}
 
+#if defined(BATCH_TRAIN) && defined(__linux__)
+/**
+ * Replaces the network of every process but the first with a copy of the first one's, passed as a checkpoint through the group.
+ * @returns The network of the process, the same one for the first process.
+ */
+template<typename T, typename S>
+nn::Network<T, S>* broadcastNetwork(nn::Network<T, S>* network, nn::ProcessGroup& group) {
+	std::string bytes;
+	if (group.rank() == 0) {
+		std::ostringstream os(std::ios::binary);
+		network->dump_network(os);
+		bytes = os.str();
+	}
+	group.broadcast(bytes);
+	if (group.rank() == 0) return network;
+
+	delete network;
+	std::istringstream is(bytes, std::ios::binary);
+	return typename nn::Network<T, S>::Builder().load(is).build();
+}
+#endif
+
+/**
+ * Runs the program with the network in scalar type T, after the checkpoint and the precision are resolved by `main()`.
+ * S is the storage type of the weights and outputs, see `nn::Network`.
+ */
+template<typename T, typename S = T>
+int run(char* checkpoint, int argc, char* argv[]) {
 	if (hasOption(argv, argv + argc, "-r")) {
 		if (!checkpoint) {
 			std::cout << "In the run mode, you must specify a weights file(.ckpt) with -c option." << std::endl;
@@ -51,10 +149,13 @@ int main(int argc, char* argv[]) {
 			std::cout << "Cannot open checkpoint file, " << checkpoint << std::endl;
 			return -2;
 		}
-		nn::Network* network = nn::Network::Builder().load(is).build();
+		nn::Network<T, S>* network = typename nn::Network<T, S>::Builder().load(is).build();
 		is.close();
+		if (!setThreads(network, argc, argv)) return -10;
 
-		double input[784];
+		T input[784];
+		std::vector<T> result(network->outputs);
+		typename nn::Network<T, S>::Workspace workspace(*network);
 		while (true) {
 			for (int i = 0; i < 784; i++) {
 				if (!(std::cin >> input[i])) {
@@ -63,8 +164,8 @@ int main(int argc, char* argv[]) {
 				input[i] /= 255;
 			}
 
-			auto result = network->predict(input);
-			double max = 0;
+			network->infer(input, &result[0], workspace);
+			T max = 0;
 			int maxi = -1;
 			for (int i = 0; i < 10; i++) {
 				if (result[i] > max) {
@@ -75,9 +176,36 @@ int main(int argc, char* argv[]) {
 			std::cout << maxi << std::endl;
 		}
 	} else {
-		srand(time(NULL));
+#if defined(BATCH_TRAIN) && defined(__linux__)
+		// Trainer processes are forked before any thread starts. Only the first one tests the network, prints and saves the checkpoints.
+		nn::ProcessGroup* group = NULL;
+		char* processes_s = getOptionValue(argv, argv + argc, "-np");
+		if (processes_s) {
+			int processes = strtol(processes_s, NULL, 10);
+			if (processes <= 0) {
+				std::cout << "Invalid process count: " << processes_s << std::endl;
+				return -12;
+			}
+			if (hasOption(argv, argv + argc, "-async")) {
+				std::cout << "Asynchronous updates cannot be shared between processes." << std::endl;
+				return -13;
+			}
+			group = nn::ProcessGroup::fork(processes);
+		}
+		const int rank = group ? group->rank() : 0;
+		const int processes = group ? group->size() : 1;
+#else
+		const int rank = 0;
+		const int processes = 1;
+#endif
+		const bool leader = rank == 0;
+		if (!leader) std::cout.setstate(std::ios::failbit);
+
+		// Each process shuffles its own shard differently, from the same seed
+		char* seed_s = getOptionValue(argv, argv + argc, "-seed");
+		nn::Random::seed((seed_s ? strtoull(seed_s, NULL, 10) : time(NULL)) + rank);
 
-		nn::Network* network;
+		nn::Network<T, S>* network;
 		int epoch;
 		if (checkpoint) {
 			char* epoch_s = getOptionValue(argv, argv + argc, "-e");
@@ -97,7 +225,7 @@ int main(int argc, char* argv[]) {
 				std::cout << "Cannot open checkpoint file, " << checkpoint << std::endl;
 				return -2;
 			}
-			network = nn::Network::Builder().load(is).build();
+			network = typename nn::Network<T, S>::Builder().load(is).build();
 			is.close();
 		} else {
 			char* h_s = getOptionValue(argv, argv + argc, "-h1");
@@ -121,14 +249,120 @@ int main(int argc, char* argv[]) {
 			}
 			
 			epoch = 0;
-			network = nn::Network::Builder()
+			network = typename nn::Network<T, S>::Builder()
 				.input(784)
-				.addLayer<DEFAULT_ACTIVATION_LAYER_1>(h1)
-				.addLayer<DEFAULT_ACTIVATION_LAYER_2>(h2)
-				.addLayer<DEFAULT_ACTIVATION_LAYER_3>(10)
+				.template addLayer<DEFAULT_ACTIVATION_LAYER_1>(h1)
+				.template addLayer<DEFAULT_ACTIVATION_LAYER_2>(h2)
+				.template addLayer<DEFAULT_ACTIVATION_LAYER_3>(10)
 				.build();
 		}
 
+#if defined(BATCH_TRAIN) && defined(__linux__)
+		if (group) {
+			network = broadcastNetwork(network, *group);
+			network->set_process_group(group);
+		}
+#endif
+
+		if (!setThreads(network, argc, argv, rank, processes)) return -10;
+
+		char* optimizer_s = getOptionValue(argv, argv + argc, "-o");
+		if (optimizer_s) {
+			int type = 0;
+			while (nn::optimizer::name(type) && std::string(optimizer_s) != nn::optimizer::name(type)) type++;
+			if (!nn::optimizer::name(type)) {
+				std::cout << "Invalid optimizer: " << optimizer_s << std::endl;
+				return -9;
+			}
+			network->set_optimizer(type);
+		}
+
+#ifdef BATCH_TRAIN
+		if (hasOption(argv, argv + argc, "-dp") && hasOption(argv, argv + argc, "-pp")) {
+			std::cout << "A batch is either split into data-parallel shards or pipelined through the layers, not both." << std::endl;
+			return -23;
+		}
+		char* shards_s = getOptionValue(argv, argv + argc, "-dp");
+		if (shards_s) {
+			int shards = strtol(shards_s, NULL, 10);
+			if (shards <= 0) {
+				std::cout << "Invalid shard count: " << shards_s << std::endl;
+				return -11;
+			}
+			network->set_data_parallel(shards);
+		} else if (hasOption(argv, argv + argc, "-dp")) {
+			network->set_data_parallel(network->thread_count());
+		}
+
+		char* micro_batches_s = getOptionValue(argv, argv + argc, "-pp");
+		if (micro_batches_s) {
+			int micro_batches = strtol(micro_batches_s, NULL, 10);
+			if (micro_batches <= 0) {
+				std::cout << "Invalid micro-batch count: " << micro_batches_s << std::endl;
+				return -14;
+			}
+			network->set_pipeline(micro_batches);
+		} else if (hasOption(argv, argv + argc, "-pp")) {
+			network->set_pipeline(4 * network->pipeline_stages());
+		}
+#endif
+#if defined(BATCH_TRAIN) && defined(MINIBATCH_COUNT)
+		const bool async = hasOption(argv, argv + argc, "-async");
+#ifdef LAZY_WEIGHT_DECAY
+		if (async) {
+			std::cout << "Asynchronous updates would race on the scale of the weights of LAZY_WEIGHT_DECAY." << std::endl;
+			return -21;
+		}
+#endif
+		/* Updates applied by each thread, and the seconds they took, since the last report */
+		std::vector<long long> async_updates(network->thread_count(), 0);
+		double async_seconds = 0;
+#endif
+
+		/* Threads distorting the train images, 0 not to distort them. They're run by the prefetcher. */
+		int augment = 0;
+		const int image_size = (int) std::lround(std::sqrt((double) network->inputs));
+		if (hasOption(argv, argv + argc, "-augment")) {
+			char* augment_s = getOptionValue(argv, argv + argc, "-augment");
+			augment = augment_s ? strtol(augment_s, NULL, 10) : 2;
+			if (augment <= 0) {
+				std::cout << "Invalid augmentation thread count: " << augment_s << std::endl;
+				return -18;
+			}
+			if (image_size * image_size != network->inputs) {
+				std::cout << "Only square images can be distorted, not " << network->inputs << " inputs." << std::endl;
+				return -19;
+			}
+		}
+
+		/* Batches gathered ahead by the prefetcher, 0 to gather them on the trainer */
+		int prefetch = 0;
+		if (hasOption(argv, argv + argc, "-prefetch") || augment > 0) {
+			char* prefetch_s = getOptionValue(argv, argv + argc, "-prefetch");
+			prefetch = prefetch_s ? strtol(prefetch_s, NULL, 10) : 4;
+			if (prefetch <= 0) {
+				std::cout << "Invalid prefetch depth: " << prefetch_s << std::endl;
+				return -16;
+			}
+#if defined(BATCH_TRAIN) && defined(MINIBATCH_COUNT)
+			if (async) {
+				std::cout << "Asynchronous updates read their minibatches in place, without prefetching." << std::endl;
+				return -17;
+			}
+#endif
+		}
+
+		/* Threads testing snapshots of the weights while the training goes on, 0 to stop the training for the tests */
+		int async_test = 0;
+		if (hasOption(argv, argv + argc, "-async-test")) {
+			char* async_test_s = getOptionValue(argv, argv + argc, "-async-test");
+			async_test = async_test_s ? strtol(async_test_s, NULL, 10) : 1;
+			if (async_test <= 0) {
+				std::cout << "Invalid test thread count: " << async_test_s << std::endl;
+				return -20;
+			}
+		}
+
 		double threshold;
 		if (hasOption(argv, argv + argc, "-t")) {
 			char* threshold_s = getOptionValue(argv, argv + argc, "-t");
@@ -146,147 +380,195 @@ int main(int argc, char* argv[]) {
 			threshold = DEFAULT_MSE_THRESHOLD;
 		}
 
+		std::cout << "Using " << nn::kernel::isa_name(nn::kernel::ops<T, S>().isa) << " kernels, " << nn::ScalarType<S>::name() << " precision, "
+			<< nn::optimizer::name(network->optimizer_type()) << " optimizer, " << network->thread_count() << " threads";
+#ifdef BATCH_TRAIN
+		if (network->data_parallel() > 1) std::cout << ", " << network->data_parallel() << " data-parallel shards";
+		if (network->pipeline() > 1) std::cout << ", " << network->pipeline_stages() << " pipeline stages of " << network->pipeline() << " micro-batches";
+#endif
+		if (processes > 1) std::cout << " in each of " << processes << " processes";
+		if (prefetch > 0) std::cout << ", " << prefetch << " batches prefetched";
+		if (augment > 0) std::cout << ", distorted by " << augment << " threads";
+		if (async_test > 0) std::cout << ", tested in the background on " << async_test << " threads";
+#if defined(BATCH_TRAIN) && defined(MINIBATCH_COUNT)
+		if (async) std::cout << ", asynchronous updates";
+#endif
+		std::cout << "." << std::endl;
 		std::cout << "Loading data set..." << std::endl;
 
-		//nn::THREE dataset("traindata.txt", "testdata.txt");
-		//nn::MNIST dataset("train.txt", "test.txt");
-		nn::MNIST_bin dataset("train.bin", "test.bin");
-
-		std::vector<nn::DataEntry> train_set, test_set;
-#pragma omp parallel
-		{
-#pragma omp single
-			{
-				train_set = dataset.get_train_set();
-#pragma omp critical
+		std::unique_ptr<nn::Dataset<T>> dataset;
+		if (getOptionValue(argv, argv + argc, "-shards")) {
+			dataset.reset(new nn::MNIST_shards<T>(getOptionValue(argv, argv + argc, "-shards"), "test.bin", rank, processes));
+		} else if (hasOption(argv, argv + argc, "-idx")) {
+			char* directory = getOptionValue(argv, argv + argc, "-idx");
+			dataset.reset(new nn::MNIST_idx<T>(directory ? directory : ".", rank, processes));
+		} else {
+			//dataset.reset(new nn::THREE<T>("traindata.txt", "testdata.txt"));
+			//dataset.reset(new nn::MNIST<T>("train.txt", "test.txt"));
+			dataset.reset(new nn::MNIST_bin<T>("train.bin", "test.bin", rank, processes));
+		}
+
+		// The binary and IDX files are only mapped here, and read as the first epoch touches them.
+		// A streamed train set is read STREAM_BUFFER samples at a time into train_set, which is trained with as a whole set.
+		nn::SampleSet train_set(network->inputs, network->outputs), test_set(network->inputs, network->outputs);
+		std::unique_ptr<nn::SampleStream> stream;
+		try {
+			stream = dataset->open_train_stream(STREAM_BUFFER);
+			if (stream) {
+				stream->next(train_set, STREAM_BUFFER);
+				std::cout << "Train set streamed from " << stream->files() << " files, total " << stream->size() << " entries." << std::endl;
+			} else {
+				train_set = dataset->get_train_samples();
 				std::cout << "Train set loaded, total " << train_set.size() << " entries." << std::endl;
 			}
-#pragma omp single
-			{
-				test_set = dataset.get_test_set();
-#pragma omp critical
-				std::cout << "Test set loaded, total " << test_set.size() << " entries." << std::endl;
-			}
+			if (leader) test_set = dataset->get_test_samples();
+			std::cout << "Test set loaded, total " << test_set.size() << " entries." << std::endl;
+		} catch (const std::exception& e) {
+			std::cout << "Cannot load the data set: " << e.what() << std::endl;
+			return -15;
 		}
 		std::cout << "Data load complete. Starting training phase..." << std::endl << std::endl;
 
 		double mse;
 
-		double sq_error = 0;
-		int error_count = 0;
-		int correct_count = 0;
-
-		for (auto iter = test_set.begin(); iter != test_set.end(); ++iter) {
-			auto result = network->predict(iter->data);
-			double lmax = 0, rmax = 0;
-			double li = -1, ri = -1;
-			for (int i = 0; i < dataset.OUTPUTS; i++) {
-				if (iter->label[i] > lmax) {
-					lmax = iter->label[i];
-					li = i;
-				}
-				if (result[i] > rmax) {
-					rmax = result[i];
-					ri = i;
-				}
-
-				double error = result[i] - iter->label[i];
-				sq_error += error * error;
-				error_count++;
-			}
-			if (li == ri) correct_count++;
-		}
-		mse = sq_error / error_count;
-		std::cout << "Before start, Test set MSE: " << mse << ", Accuracy: " << correct_count * 100.0 / test_set.size() << '%' << std::endl;
+		nn::Evaluator<T, S> evaluator(*network);
+		nn::Evaluation evaluation = evaluator.evaluate(test_set);
+		mse = evaluation.mse();
+		std::cout << "Before start, Test set MSE: " << mse << ", Accuracy: " << evaluation.accuracy() * 100 << '%' << std::endl;
 
 		bool mse_updated = false;
+		std::unique_ptr<nn::AsyncEvaluator<T, S>> async_evaluator;
+		if (async_test > 0) async_evaluator.reset(new nn::AsyncEvaluator<T, S>(*network, test_set, async_test));
 
 #ifndef MINIBATCH_COUNT
 		const int batch_size = train_set.size();
+#else
+		const int batch_size = MINIBATCH_COUNT;
+		int batch_begin = 0;
+#ifdef BATCH_TRAIN
+		// The asynchronous epoch counts down whole batches of the train set, so it never moves on with a set shorter than a batch
+		if (async && train_set.size() < (size_t) batch_size) {
+			std::cout << "The train set of " << train_set.size() << " entries is shorter than a batch of " << batch_size << " for asynchronous updates." << std::endl;
+			return -22;
+		}
+#endif
+#endif
+		// The prefetcher takes over train_set, moving on to the next samples on its own thread as the batches are gathered
+		nn::SampleStream* train_stream = stream.get();
+		std::unique_ptr<nn::Prefetcher<T, S>> prefetcher;
+		std::unique_ptr<nn::Augmenter<T, S>> augmenter;
+		if (augment > 0) augmenter.reset(new nn::Augmenter<T, S>(image_size, image_size, nn::AugmentParams::defaults()));
+		if (prefetch > 0) {
+			prefetcher.reset(new nn::Prefetcher<T, S>(train_set, batch_size, prefetch + 1, [=](nn::SampleSet& samples) {
+				nextSamples(samples, train_stream, batch_size);
+			}, !train_stream, augmenter.get(), augment));
+		}
+
+#ifndef MINIBATCH_COUNT
 		for (int start = ++epoch; ; epoch++) {
 			for (int i = 0; i < TRAINS_PER_EPOCH; i++) {
-				std::random_shuffle(train_set.begin(), train_set.end());
-				network->train(batch_size, &train_set[0]);
+				if (prefetcher) {
+					network->train(prefetcher->acquire());
+					prefetcher->release();
+					continue;
+				}
+				nextSamples(train_set, stream.get(), batch_size);
+				network->train(batch_size, train_set, 0);
 			}
 #else
-		const int batch_size = MINIBATCH_COUNT;
-		int batch_begin = 0;
 		for (int start = ++epoch; ; epoch++) {
+#ifdef BATCH_TRAIN
+			// The minibatches of the epoch are taken by the threads in turn, split only where the dataset is shuffled.
+			for (int remaining = TRAINS_PER_EPOCH * batch_size; async && remaining > 0; ) {
+				if ((size_t) (batch_begin + batch_size) > train_set.size()) {
+					nextSamples(train_set, stream.get(), batch_size);
+					batch_begin = 0;
+				}
+
+				const int count = std::min(remaining, (int) (train_set.size() - batch_begin) / batch_size * batch_size);
+				auto async_start = std::chrono::steady_clock::now();
+				std::vector<int> updates = network->train_async(count, train_set, batch_begin, batch_size);
+				async_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - async_start).count();
+				for (size_t t = 0; t < updates.size(); t++) async_updates[t] += updates[t];
+				if (!stream) train_set.shuffle_ahead(count);
+
+				batch_begin += count;
+				remaining -= count;
+			}
+			for (int i = 0; !async && i < TRAINS_PER_EPOCH; i++) {
+#else
 			for (int i = 0; i < TRAINS_PER_EPOCH; i++) {
+#endif
+				if (prefetcher) {
+					network->train(prefetcher->acquire());
+					prefetcher->release();
+					continue;
+				}
+
 				// Shuffle only when the dataset reached end. This may prevent duplicates in training.
 				if (batch_begin + batch_size > train_set.size()) {
-					std::random_shuffle(train_set.begin(), train_set.end());
+					nextSamples(train_set, stream.get(), batch_size);
 					batch_begin = 0;
 				}
 
-				network->train(batch_size, &train_set[batch_begin]);
+				network->train(batch_size, train_set, batch_begin);
 				batch_begin += batch_size;
+				// Draws the next order of the samples a batch at a time, to have it ready at the end of the pass
+				if (!stream) train_set.shuffle_ahead(batch_size);
 			}
 #endif
 
 			if (epoch % TEST_EPOCHES == 0) {
 				std::cout << "Epoch #" << epoch << " finished,";
 
+#if defined(BATCH_TRAIN) && defined(MINIBATCH_COUNT)
+				if (async) {
+					std::cout << "\tUpdates/s per thread:";
+					for (size_t t = 0; t < async_updates.size(); t++) {
+						std::cout << ' ' << (long long) (async_updates[t] / async_seconds) << ',';
+						async_updates[t] = 0;
+					}
+					async_seconds = 0;
+				}
+#endif
+				if (prefetcher) {
+					const typename nn::Prefetcher<T, S>::Stats stats = prefetcher->get_stats();
+					std::cout << "\tPrefetch: " << (long long) stats.producer_rate() << " samples/s gathered, "
+						<< (long long) stats.trainer_rate(batch_size) << " trained, "
+						<< stats.stalls << " stalls of " << stats.batches << " batches(" << stats.stall_seconds << "s), "
+						<< stats.average_depth() << " batches ahead,";
+					prefetcher->reset_stats();
+				}
+
 #ifdef PRINT_TRAIN_ERROR
 				{
-					sq_error = 0;
-					error_count = 0;
-					correct_count = 0;
-					for (auto iter = train_set.begin(); iter != train_set.end(); ++iter) {
-						auto result = network->predict(iter->data);
-						double lmax = 0, rmax = 0;
-						double li = -1, ri = -1;
-						for (int i = 0; i < dataset.OUTPUTS; i++) {
-							if (iter->label[i] > lmax) {
-								lmax = iter->label[i];
-								li = i;
-							}
-							if (result[i] > rmax) {
-								rmax = result[i];
-								ri = i;
-							}
-
-							double error = result[i] - iter->label[i];
-							sq_error += error * error;
-							error_count++;
-						}
-						if (li == ri) correct_count++;
-					}
-					mse = sq_error / error_count;
-					std::cout << "\tTrain: MSE: " << mse << ",\tAcc: " << correct_count * 100.0 / train_set.size() << "%,";
+					std::unique_lock<std::mutex> lock;
+					if (prefetcher) lock = prefetcher->lock_samples();
+					evaluation = evaluator.evaluate(train_set);
+					std::cout << "\tTrain: MSE: " << evaluation.mse() << ",\tAcc: " << evaluation.accuracy() * 100 << "%,";
 				}
 #endif
 
-				sq_error = 0;
-				error_count = 0;
-				correct_count = 0;
-				for (auto iter = test_set.begin(); iter != test_set.end(); ++iter) {
-					auto result = network->predict(iter->data);
-					double lmax = 0, rmax = 0;
-					double li = -1, ri = -1;
-					for (int i = 0; i < dataset.OUTPUTS; i++) {
-						if (iter->label[i] > lmax) {
-							lmax = iter->label[i];
-							li = i;
-						}
-						if (result[i] > rmax) {
-							rmax = result[i];
-							ri = i;
-						}
-
-						double error = result[i] - iter->label[i];
-						sq_error += error * error;
-						error_count++;
+				if (async_evaluator) {
+					// The result of an earlier epoch, if one is done, and the weights of this epoch are tested meanwhile unless the last test is still running
+					int tested;
+					if (async_evaluator->poll(tested, evaluation)) {
+						mse = evaluation.mse();
+						std::cout << "\tTest of #" << tested << ": MSE: " << mse << ",\tAcc: " << evaluation.accuracy() * 100 << '%';
+						mse_updated = leader;
 					}
-					if (li == ri) correct_count++;
+					if (!async_evaluator->start(epoch)) std::cout << "\tTest of #" << epoch << " skipped, the last one is still running";
+					std::cout << std::endl;
+				} else {
+					evaluation = evaluator.evaluate(test_set);
+					mse = evaluation.mse();
+					std::cout  << "\tTest: MSE: " << mse << ",\tAcc: " << evaluation.accuracy() * 100 << '%' << std::endl;
+
+					mse_updated = leader;
 				}
-				mse = sq_error / error_count;
-				std::cout  << "\tTest: MSE: " << mse << ",\tAcc: " << correct_count * 100.0 / test_set.size() << '%' << std::endl;
-
-				mse_updated = true;
 			}
 
-			if (epoch % CHECKPOINT_EPOCHES == 0) {
+			if (leader && epoch % CHECKPOINT_EPOCHES == 0) {
 				char ckptfile[300];
 				snprintf(ckptfile, 100, "./ckpt/%d.ckpt", epoch);
 
@@ -300,45 +582,118 @@ int main(int argc, char* argv[]) {
 				std::cout << "Save complete." << std::endl << std::endl;
 			}
 
-			if (mse_updated && mse <= threshold) {
+			bool stop = false;
+			// Only the first process tests, and reads the answer from stdin
+			if (leader && mse_updated && mse <= threshold) {
 				std::cout << "MSE reached the threshold, run more epoches?(Y/n) ";
 				std::string line;
 				std::getline(std::cin, line);
-				if (line == "N" || line == "n")
-					break;
+				stop = line == "N" || line == "n";
 
-				std::cout << std::endl;
+				if (!stop) std::cout << std::endl;
 				mse_updated = false;
 			}
+#if defined(BATCH_TRAIN) && defined(__linux__)
+			// The other processes stop along with the first one, which is the only one testing
+			if (group && epoch % TEST_EPOCHES == 0) group->broadcast(&stop, sizeof(stop));
+#endif
+			if (stop) break;
 		}
 
-		int count = 0;
-		int correct = 0;
-		for (auto iter = test_set.begin(); iter != test_set.end(); ++iter) {
-			auto data = iter->data;
-			auto label = iter->label;
+		evaluation = evaluator.evaluate(test_set);
+		std::cout << "Test data accuracy: " << evaluation.accuracy()
+			<< " (" << evaluation.correct << " / " << evaluation.count << " correct)" << std::endl;
+		if (leader) printConfusion(evaluation);
+#if defined(BATCH_TRAIN) && defined(__linux__)
+		delete group;
+#endif
+	}
+	return 0;
+}
 
-			auto output = network->predict(data);
+int main(int argc, char* argv[]) {
+	if (hasOption(argv, argv + argc, "-h")) {
+		std::cout	<< "========================================= Neural Network Trainer - Usage =========================================" << std::endl
+					<< " Train Mode: MNIST_NN [-h1 {Neurons in 1st hidden layer}] [-h2 {Neurons in 2nd hidden layer}] [-t {MSE threshold}]" << std::endl
+					<< "  or to start from a checkpoint: MNIST_NN -c {Checkpoint file} -e {Epoch count} [-t {MSE threshold}]" << std::endl
+					<< "  > The program reads two files, train.bin and test.bin, and starts training until MSE reaches the threshold" << std::endl
+					<< "    or with -idx [{directory}], the original MNIST files(train-images-idx3-ubyte, ...) in the directory, the current one by default" << std::endl
+					<< "    or with -shards {directory}, streams the .bin files of the directory as the train set, to train on sets larger than memory" << std::endl
+					<< "  > threshold defaults to " STR(DEFAULT_MSE_THRESHOLD) ", "
+							"h1 defaults to " STR(DEFAULT_HIDDEN_LAYER_1) ", "
+							"h2 defaults to " STR(DEFAULT_HIDDEN_LAYER_2) << std::endl
+					<< "  > add -p f32 to train in single precision instead of " << nn::ScalarType<nn::NUM_TYPE>::name() << "," << std::endl
+					<< "    or -p {bf16|f16} to store the weights in 16 bits, while updating them in single precision" << std::endl
+					<< "  > -o {gd|momentum|nesterov|adagrad|rmsprop|adam} selects the optimizer, defaults to " << nn::optimizer::name(DEFAULT_OPTIMIZER) << std::endl
+					<< "  > -j {threads} sets the number of threads, one per hardware thread by default," << std::endl
+					<< "    and -a [{cpu,cpu,...}] pins them to the CPUs given, or to the CPUs from 0 in order" << std::endl
+					<< "  > -seed {seed} seeds the weights, the shuffles, the dropout and the distortions instead of the time," << std::endl
+					<< "    to repeat a run with the same thread options(not with -async, whose updates race)" << std::endl
+					<< "  > -prefetch [{batches}] gathers the next batches on a thread of their own while the network trains, four by default," << std::endl
+					<< "    reporting how often the training waited for them" << std::endl
+					<< "  > -augment [{threads}] distorts the train images anew every time they're prefetched, on two threads by default" << std::endl
+					<< "  > -async-test [{threads}] tests a copy of the weights in the background while the training goes on, on one thread by default" << std::endl
+#ifdef BATCH_TRAIN
+					<< "  > -dp [{shards}] splits each batch into shards trained in parallel, one per thread by default" << std::endl
+					<< "  > -pp [{micro-batches}] pipelines the layers over the threads, passing each batch through them in micro-batches," << std::endl
+					<< "    four per pipeline stage by default, not together with -dp" << std::endl
+#ifdef MINIBATCH_COUNT
+					<< "  > -async lets each thread update the weights with its own minibatches without waiting for the others(Hogwild!)," << std::endl
+					<< "    reporting the updates per second of each thread" << std::endl
+#endif
+#ifdef __linux__
+					<< "  > -np {processes} trains in that many processes, each with its share of train.bin and of the threads," << std::endl
+					<< "    summing up their gradients through shared memory for every batch" << std::endl
+#endif
+#endif
+					<< " Run Mode: MNIST_NN -r -c {Checkpoint file}" << std::endl
+					<< "  > Input 784 integers in range 0~255 through standard input to get the predicted number. Program ends on EOF." << std::endl
+					<< "  > A checkpoint runs in the precision it was saved with, unless overridden with -p {f32|f64|bf16|f16}" << std::endl
+					<< "==================================================================================================================" << std::endl;
+		return 0;
+	}
 
-			double max_ans = 0, max_res = 0;
-			int i_ans = 0, i_res = 0;
-			for (int i = 0; i < dataset.OUTPUTS; i++) {
-				if (label[i] > max_ans) {
-					max_ans = label[i];
-					i_ans = i;
-				}
-				if (output[i] > max_res) {
-					max_res = output[i];
-					i_res = i;
-				}
-			}
-			if (i_ans == i_res) {
-				correct++;
-			}
-			count++;
+	char* checkpoint = getOptionValue(argv, argv + argc, "-c");
+
+	int scalar_type = nn::ScalarType<nn::NUM_TYPE>::id;
+	if (checkpoint) {
+		std::ifstream is(checkpoint, std::ios::binary);
+		if (is.fail()) {
+			std::cout << "Cannot open checkpoint file, " << checkpoint << std::endl;
+			return -2;
+		}
+		scalar_type = nn::checkpoint_scalar_type(is);
+		if (scalar_type < 0) {
+			std::cout << "Not a valid checkpoint file, " << checkpoint << std::endl;
+			return -2;
 		}
-		std::cout << "Test data accuracy: " << (double)correct / count
-			<< " (" << correct << " / " << count << " correct)" << std::endl;
 	}
-	return 0;
+
+	char* precision = getOptionValue(argv, argv + argc, "-p");
+	if (precision) {
+		std::string p(precision);
+		if (p == "f32" || p == "float32") {
+			scalar_type = nn::scalar_types::Float32;
+		} else if (p == "f64" || p == "float64") {
+			scalar_type = nn::scalar_types::Float64;
+		} else if (p == "bf16" || p == "bfloat16") {
+			scalar_type = nn::scalar_types::BFloat16;
+		} else if (p == "f16" || p == "float16") {
+			scalar_type = nn::scalar_types::Float16;
+		} else {
+			std::cout << "Invalid precision: " << precision << std::endl;
+			return -8;
+		}
+	}
+
+	switch (scalar_type) {
+	case nn::scalar_types::Float32:
+		return run<float>(checkpoint, argc, argv);
+	case nn::scalar_types::BFloat16:
+		return run<float, nn::bf16>(checkpoint, argc, argv);
+	case nn::scalar_types::Float16:
+		return run<float, nn::fp16>(checkpoint, argc, argv);
+	default:
+		return run<double>(checkpoint, argc, argv);
+	}
 }